@@ -26,11 +26,13 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <optional>
 #include <string_view>
 #include <initializer_list>
 
 namespace curly_hpp
 {
+    class engine;
     class request;
     class response;
     class request_builder;
@@ -39,6 +41,7 @@ namespace curly_hpp
 
     using time_sec_t = std::chrono::seconds;
     using time_ms_t = std::chrono::milliseconds;
+    using time_us_t = std::chrono::microseconds;
     using time_point_t = std::chrono::steady_clock::time_point;
 
     enum class http_method {
@@ -51,6 +54,20 @@ namespace curly_hpp
         OPTIONS
     };
 
+    enum class http_version {
+        any,
+        http1_1,
+        http2,
+        http2_tls,
+        http2_prior_knowledge
+    };
+
+    enum class req_priority {
+        low,
+        normal,
+        high
+    };
+
     class upload_handler {
     public:
         virtual ~upload_handler() = default;
@@ -72,6 +89,9 @@ namespace curly_hpp
             std::size_t unow, std::size_t utotal) = 0;
     };
 
+    using task_t = std::function<void()>;
+    using executor_t = std::function<void(task_t)>;
+
     using callback_t = std::function<void(request)>;
     using uploader_uptr = std::unique_ptr<upload_handler>;
     using downloader_uptr = std::unique_ptr<download_handler>;
@@ -176,6 +196,18 @@ namespace curly_hpp
 
 namespace curly_hpp
 {
+    // timings are counted from the start of the transfer, as libcurl does;
+    // a resolver cache hit shows up as a near zero name_lookup and
+    // a reused connection as zero new_connections and tls_handshake
+    struct transfer_stats final {
+        time_us_t name_lookup{0};
+        time_us_t connect{0};
+        time_us_t tls_handshake{0};
+        time_us_t start_transfer{0};
+        time_us_t total{0};
+        std::size_t new_connections{0u};
+    };
+
     class response final {
     public:
         response() = default;
@@ -190,6 +222,11 @@ namespace curly_hpp
         : last_url_(u)
         , http_code_(c) {}
 
+        explicit response(std::string u, http_code_t c, http_version v) noexcept
+        : last_url_(u)
+        , http_code_(c)
+        , http_version_(v) {}
+
         bool is_http_error() const noexcept {
             return http_code_ >= 400u;
         }
@@ -201,15 +238,21 @@ namespace curly_hpp
         http_code_t http_code() const noexcept {
             return http_code_;
         }
+
+        http_version version() const noexcept {
+            return http_version_;
+        }
     public:
         content_t content;
         headers_t headers;
+        transfer_stats stats;
         uploader_uptr uploader;
         downloader_uptr downloader;
         progressor_uptr progressor;
     private:
         std::string last_url_;
         http_code_t http_code_{0u};
+        http_version http_version_{http_version::any};
     };
 }
 
@@ -285,12 +328,18 @@ namespace curly_hpp
         request_builder& headers(header_ilist_t hs);
         request_builder& header(std::string k, std::string v);
 
+        request_builder& version(http_version v) noexcept;
+        request_builder& pipewait(bool v) noexcept;
+        request_builder& stream_weight(std::uint16_t w) noexcept;
+        request_builder& priority(req_priority p) noexcept;
+
         request_builder& verbose(bool v) noexcept;
         request_builder& verification(bool v) noexcept;
         request_builder& redirections(std::uint32_t r) noexcept;
         request_builder& request_timeout(time_ms_t t) noexcept;
         request_builder& response_timeout(time_ms_t t) noexcept;
         request_builder& connection_timeout(time_ms_t t) noexcept;
+        request_builder& deadline(time_point_t tp) noexcept;
 
         request_builder& content(std::string_view b);
         request_builder& content(content_t b) noexcept;
@@ -304,12 +353,18 @@ namespace curly_hpp
         const qparams_t& qparams() const noexcept;
         const headers_t& headers() const noexcept;
 
+        http_version version() const noexcept;
+        bool pipewait() const noexcept;
+        std::uint16_t stream_weight() const noexcept;
+        req_priority priority() const noexcept;
+
         bool verbose() const noexcept;
         bool verification() const noexcept;
         std::uint32_t redirections() const noexcept;
         time_ms_t request_timeout() const noexcept;
         time_ms_t response_timeout() const noexcept;
         time_ms_t connection_timeout() const noexcept;
+        time_point_t deadline() const noexcept;
 
         content_t& content() noexcept;
         const content_t& content() const noexcept;
@@ -327,6 +382,16 @@ namespace curly_hpp
         const progressor_uptr& progressor() const noexcept;
 
         request send();
+        request send(engine& e);
+
+        std::optional<request> try_send();
+        std::optional<request> try_send(engine& e);
+
+        std::optional<request> try_send_for(time_ms_t ms);
+        std::optional<request> try_send_for(engine& e, time_ms_t ms);
+
+        std::optional<request> try_send_until(time_point_t tp);
+        std::optional<request> try_send_until(engine& e, time_point_t tp);
 
         template < typename Iter >
         request_builder& qparams(Iter first, Iter last) {
@@ -382,12 +447,17 @@ namespace curly_hpp
         http_method method_{http_method::GET};
         qparams_t qparams_;
         headers_t headers_;
+        http_version version_{http_version::any};
+        bool pipewait_{false};
+        std::uint16_t stream_weight_{16u};
+        req_priority priority_{req_priority::normal};
         bool verbose_{false};
         bool verification_{false};
         std::uint32_t redirections_{10u};
         time_ms_t request_timeout_{time_sec_t{~0u}};
         time_ms_t response_timeout_{time_sec_t{60u}};
         time_ms_t connection_timeout_{time_sec_t{20u}};
+        time_point_t deadline_{time_point_t::max()};
     private:
         content_t content_;
         callback_t callback_;
@@ -399,16 +469,179 @@ namespace curly_hpp
 
 namespace curly_hpp
 {
+    class thread_pool final {
+    public:
+        class internal_state;
+        using internal_state_ptr = std::shared_ptr<internal_state>;
+    public:
+        explicit thread_pool(std::size_t threads);
+        ~thread_pool() noexcept;
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        void post(task_t task);
+        executor_t executor() const;
+    private:
+        internal_state_ptr state_;
+    };
+}
+
+namespace curly_hpp
+{
+    using socket_t = std::intptr_t;
+
+    struct socket_events final {
+        bool read{false};
+        bool write{false};
+        bool error{false};
+    };
+
+    // lets a host event loop drive a single shard engine instead of a performer,
+    // the hooks are called under the engine lock, so they must not call back into it
+    struct loop_hooks final {
+        // starts, changes or stops (no events at all) watching a socket,
+        // called on the loop thread and on threads that cancel requests
+        std::function<void(socket_t, socket_events)> watch;
+        // sets the one-shot timer of the loop, time_point_t::max() cancels it
+        std::function<void(time_point_t)> timer;
+        // called from any thread, the loop should call on_wakeup() soon
+        std::function<void()> wakeup;
+    };
+
+    struct drain_report final {
+        // in-flight requests that have finished before the deadline
+        std::size_t finished{0u};
+        // in-flight requests that have been cancelled at the deadline
+        std::size_t cancelled_active{0u};
+        // queued requests that have never been admitted
+        std::size_t cancelled_queued{0u};
+    };
+
+    class engine final {
+    public:
+        class internal_state;
+        using internal_state_ptr = std::shared_ptr<internal_state>;
+    public:
+        engine();
+        explicit engine(std::size_t shards);
+        ~engine() noexcept;
+
+        engine(const engine&) = delete;
+        engine& operator=(const engine&) = delete;
+
+        static engine& default_engine();
+
+        std::size_t shard_count() const noexcept;
+
+        executor_t executor() const;
+        void executor(executor_t e);
+
+        bool completion_queue() const noexcept;
+        void completion_queue(bool enable) noexcept;
+
+        std::size_t handle_pool_size() const noexcept;
+        void handle_pool_size(std::size_t size);
+
+        std::size_t max_host_connections() const noexcept;
+        void max_host_connections(std::size_t count);
+
+        std::size_t max_total_connections() const noexcept;
+        void max_total_connections(std::size_t count);
+
+        std::size_t max_idle_connections() const noexcept;
+        void max_idle_connections(std::size_t count);
+
+        time_sec_t max_idle_time() const noexcept;
+        void max_idle_time(time_sec_t t);
+
+        time_sec_t max_connection_lifetime() const noexcept;
+        void max_connection_lifetime(time_sec_t t);
+
+        bool multiplexing() const noexcept;
+        void multiplexing(bool enable);
+
+        std::size_t max_active_requests() const noexcept;
+        void max_active_requests(std::size_t count) noexcept;
+
+        std::size_t max_host_requests() const noexcept;
+        void max_host_requests(std::size_t count) noexcept;
+
+        double max_request_rate() const noexcept;
+        void max_request_rate(double per_second);
+
+        double max_host_request_rate() const noexcept;
+        void max_host_request_rate(double per_second);
+
+        std::size_t max_request_burst() const noexcept;
+        void max_request_burst(std::size_t count) noexcept;
+
+        std::size_t max_queued_requests() const noexcept;
+        void max_queued_requests(std::size_t count) noexcept;
+
+        std::size_t poll_completions(std::vector<request>& dst, std::size_t max);
+        std::size_t wait_completions(std::vector<request>& dst, std::size_t max, time_ms_t ms);
+
+        void perform();
+        void wait_activity(time_ms_t ms);
+
+        void attach_loop(loop_hooks hooks);
+        void on_socket_ready(socket_t s, socket_events events);
+        void on_timeout();
+        void on_wakeup();
+
+        drain_report drain(time_point_t deadline);
+        void cancel_all_pending_requests();
+        std::vector<request> get_all_pending_requests() const;
+        void get_all_pending_requests(std::vector<request>& dst) const;
+    private:
+        friend class performer;
+        friend class request_builder;
+        friend std::vector<request> send_all(engine& e, std::vector<request_builder> builders);
+        internal_state_ptr state_;
+    };
+}
+
+namespace curly_hpp
+{
+    struct thread_options final {
+        // threads of several shards get their index appended,
+        // and the whole name is cut to 15 characters
+        std::string name;
+        // the threads are allowed to run on these cpus only, empty means any
+        std::vector<std::size_t> cpus;
+        // a SCHED_* policy with its priority, negative means inherited
+        int sched_policy{-1};
+        int sched_priority{0};
+    };
+
     class performer final {
     public:
+        // an engine can be driven by one performer at a time
         performer();
+        explicit performer(engine& e);
+        performer(engine& e, thread_options options);
         ~performer() noexcept;
 
+        performer(const performer&) = delete;
+        performer& operator=(const performer&) = delete;
+
         time_ms_t wait_activity() const noexcept;
         void wait_activity(time_ms_t ms) noexcept;
+
+        time_us_t spin_time() const noexcept;
+        void spin_time(time_us_t us) noexcept;
+
+        time_ms_t backoff_time() const noexcept;
+        void backoff_time(time_ms_t ms) noexcept;
     private:
-        std::thread thread_;
-        time_ms_t wait_activity_{100};
+        void stop_() noexcept;
+    private:
+        engine::internal_state_ptr engine_;
+        std::vector<std::thread> threads_;
+        std::atomic<time_ms_t> wait_activity_{time_ms_t(100)};
+        std::atomic<time_us_t> spin_time_{time_us_t(0)};
+        std::atomic<time_ms_t> backoff_time_{time_ms_t(100)};
         std::atomic<bool> done_{false};
     };
 }
@@ -418,7 +651,17 @@ namespace curly_hpp
     void perform();
     void wait_activity(time_ms_t ms);
 
+    drain_report drain(time_point_t deadline);
     void cancel_all_pending_requests();
     std::vector<request> get_all_pending_requests();
     void get_all_pending_requests(std::vector<request>& dst);
+
+    std::vector<request> send_all(std::vector<request_builder> builders);
+    std::vector<request> send_all(engine& e, std::vector<request_builder> builders);
+
+    std::size_t poll_completions(std::vector<request>& dst, std::size_t max);
+    std::size_t wait_completions(std::vector<request>& dst, std::size_t max, time_ms_t ms);
+
+    void set_shard_count(std::size_t count);
+    std::size_t shard_count() noexcept;
 }
@@ -6,13 +6,25 @@
 
 #include <curly.hpp/curly.hpp>
 
+#include <array>
 #include <mutex>
 #include <deque>
+#include <limits>
+#include <unordered_map>
 #include <type_traits>
 #include <condition_variable>
 
 #include <curl/curl.h>
 
+#if defined(__linux__)
+#  include <cerrno>
+#  include <sched.h>
+#  include <pthread.h>
+#  include <unistd.h>
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+#endif
+
 // -----------------------------------------------------------------------------
 //
 // types
@@ -102,65 +114,371 @@ namespace
     using namespace curly_hpp;
 
     template < typename T >
-    class mt_queue final {
+    class mpsc_queue final {
     public:
+        mpsc_queue() = default;
+
+        mpsc_queue(const mpsc_queue&) = delete;
+        mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+        ~mpsc_queue() noexcept {
+            node* head = head_.exchange(nullptr);
+            while ( head ) {
+                delete std::exchange(head, head->next);
+            }
+        }
+
         template < typename U >
         void enqueue(U&& u) {
-            std::lock_guard<std::mutex> guard(mutex_);
-            deque_.push_back(std::forward<U>(u));
-            cvar_.notify_all();
+            node* n = new node{std::forward<U>(u), head_.load(std::memory_order_relaxed)};
+            while ( !head_.compare_exchange_weak(n->next, n) ) {}
         }
 
-        bool try_dequeue(T& v) {
-            std::lock_guard<std::mutex> guard(mutex_);
-            if ( deque_.empty() ) {
-                return false;
+        template < typename Iter >
+        void enqueue_all(Iter first, Iter last) {
+            node* batch_head = nullptr;
+            node* batch_tail = nullptr;
+            try {
+                for ( ; first != last; ++first ) {
+                    batch_head = new node{*first, batch_head};
+                    if ( !batch_tail ) {
+                        batch_tail = batch_head;
+                    }
+                }
+            } catch (...) {
+                while ( batch_head ) {
+                    delete std::exchange(batch_head, batch_head->next);
+                }
+                throw;
+            }
+            if ( batch_head ) {
+                batch_tail->next = head_.load(std::memory_order_relaxed);
+                while ( !head_.compare_exchange_weak(batch_tail->next, batch_head) ) {}
+            }
+        }
+
+        // consumer only: appends everything enqueued so far in FIFO order
+        void dequeue_all(std::vector<T>& dst) {
+            node* head = head_.exchange(nullptr);
+            if ( !head ) {
+                return;
+            }
+            try {
+                std::size_t count = 0u;
+                for ( const node* n = head; n; n = n->next ) {
+                    ++count;
+                }
+                dst.reserve(dst.size() + count);
+            } catch (...) {
+                // give the batch back rather than losing it
+                node* tail = head;
+                while ( tail->next ) {
+                    tail = tail->next;
+                }
+                tail->next = head_.load(std::memory_order_relaxed);
+                while ( !head_.compare_exchange_weak(tail->next, head) ) {}
+                throw;
+            }
+            node* reversed = nullptr;
+            while ( head ) {
+                reversed = std::exchange(head, std::exchange(head->next, reversed));
+            }
+            while ( reversed ) {
+                dst.push_back(std::move(reversed->value));
+                delete std::exchange(reversed, reversed->next);
             }
-            v = std::move(deque_.front());
-            deque_.pop_front();
-            return true;
         }
 
         bool empty() const noexcept {
-            std::lock_guard<std::mutex> guard(mutex_);
-            return deque_.empty();
+            return !head_.load();
+        }
+    private:
+        struct node {
+            T value;
+            node* next;
+        };
+        std::atomic<node*> head_{nullptr};
+    };
+
+    // intrusive min-heap of T*, keyed by T::timeout_deadline(),
+    // every item keeps its own position in T::timeout_index()
+    template < typename T >
+    class timeout_heap final {
+    public:
+        static constexpr std::size_t npos{~std::size_t(0u)};
+    public:
+        bool empty() const noexcept {
+            return items_.empty();
         }
 
-        void wait() const noexcept {
-            std::unique_lock<std::mutex> lock(mutex_);
-            cvar_.wait(lock, [this](){
-                return !deque_.empty();
-            });
+        T* top() const noexcept {
+            assert(!items_.empty());
+            return items_.front();
         }
 
-        template < typename Rep, typename Period >
-        bool wait_for(const std::chrono::duration<Rep, Period> duration) const noexcept {
-            std::unique_lock<std::mutex> lock(mutex_);
-            return cvar_.wait_for(lock, duration, [this](){
-                return !deque_.empty();
-            });
+        void push(T* item) {
+            items_.push_back(item);
+            item->timeout_index(items_.size() - 1u);
+            sift_up_(items_.size() - 1u);
         }
 
-        template < typename Clock, typename Duration >
-        bool wait_until(const std::chrono::time_point<Clock, Duration>& time) const noexcept {
-            std::unique_lock<std::mutex> lock(mutex_);
-            return cvar_.wait_until(lock, time, [this](){
-                return !deque_.empty();
-            });
+        void remove(T* item) noexcept {
+            const std::size_t index = item->timeout_index();
+            if ( index >= items_.size() || items_[index] != item ) {
+                return;
+            }
+            item->timeout_index(npos);
+            if ( index + 1u == items_.size() ) {
+                items_.pop_back();
+                return;
+            }
+            items_[index] = items_.back();
+            items_[index]->timeout_index(index);
+            items_.pop_back();
+            update_(index);
         }
 
-        template < typename Container >
-        void copy_to(Container&& container) const {
-            std::lock_guard<std::mutex> guard(mutex_);
-            container.insert(container.end(), deque_.begin(), deque_.end());
+        // restores the heap after the deadline of the item has been changed
+        void update(T* item) noexcept {
+            const std::size_t index = item->timeout_index();
+            if ( index < items_.size() && items_[index] == item ) {
+                update_(index);
+            }
+        }
+
+        void clear() noexcept {
+            for ( T* item : items_ ) {
+                item->timeout_index(npos);
+            }
+            items_.clear();
+        }
+    private:
+        void update_(std::size_t index) noexcept {
+            if ( index > 0u && less_(index, (index - 1u) / 2u) ) {
+                sift_up_(index);
+            } else {
+                sift_down_(index);
+            }
+        }
+
+        void sift_up_(std::size_t index) noexcept {
+            while ( index > 0u ) {
+                const std::size_t parent = (index - 1u) / 2u;
+                if ( !less_(index, parent) ) {
+                    break;
+                }
+                swap_(index, parent);
+                index = parent;
+            }
+        }
+
+        void sift_down_(std::size_t index) noexcept {
+            while ( true ) {
+                const std::size_t left = index * 2u + 1u;
+                const std::size_t right = left + 1u;
+                std::size_t least = index;
+                if ( left < items_.size() && less_(left, least) ) {
+                    least = left;
+                }
+                if ( right < items_.size() && less_(right, least) ) {
+                    least = right;
+                }
+                if ( least == index ) {
+                    break;
+                }
+                swap_(index, least);
+                index = least;
+            }
+        }
+
+        bool less_(std::size_t l, std::size_t r) const noexcept {
+            return items_[l]->timeout_deadline() < items_[r]->timeout_deadline();
+        }
+
+        void swap_(std::size_t l, std::size_t r) noexcept {
+            std::swap(items_[l], items_[r]);
+            items_[l]->timeout_index(l);
+            items_[r]->timeout_index(r);
+        }
+    private:
+        std::vector<T*> items_;
+    };
+
+    // queued requests of a shard, the hosts of every priority take turns
+    // and each keeps its own line, so the admission goes from host to host
+    // and never walks the requests waiting behind, items keep their place
+    // in T::is_queued() and those taken out are dropped from the lines later
+    template < typename T >
+    class admission_queue final {
+    public:
+        using item_ptr = std::shared_ptr<T>;
+
+        enum class verdict {
+            taken,
+            blocked,
+            stop
+        };
+    public:
+        bool empty() const noexcept {
+            return size_ == 0u;
+        }
+
+        std::size_t size() const noexcept {
+            return size_;
+        }
+
+        void push(item_ptr item) {
+            level& lvl = levels_[level_index_(*item)];
+            host_entry& host = *lvl.hosts.try_emplace(item->origin()).first;
+            // a host is in the round exactly while its line isn't empty
+            const bool idle = host.second.empty();
+            if ( idle ) {
+                lvl.round.push_back(&host);
+            }
+            T& value = *item;
+            try {
+                host.second.push_back(std::move(item));
+            } catch (...) {
+                if ( idle ) {
+                    lvl.round.pop_back();
+                }
+                throw;
+            }
+            value.queued(true);
+            ++size_;
+        }
+
+        void remove(T& item) noexcept {
+            if ( item.is_queued() ) {
+                item.queued(false);
+                --size_;
+            }
+        }
+
+        // offers the first items of the hosts in turns, higher priorities
+        // first, F tells whether the item has been taken, whether its host
+        // must wait, or whether nothing may go, and the next call picks up
+        // from the host where this one has stopped
+        template < typename F >
+        void admit(F&& f) {
+            for ( auto lvl = levels_.rbegin(); lvl != levels_.rend(); ++lvl ) {
+                std::size_t blocked = 0u;
+                while ( blocked < lvl->round.size() ) {
+                    host_entry* host = lvl->round.front();
+                    std::deque<item_ptr>& line = host->second;
+                    while ( !line.empty() && !line.front()->is_queued() ) {
+                        line.pop_front();
+                    }
+                    if ( line.empty() ) {
+                        lvl->round.pop_front();
+                        lvl->hosts.erase(lvl->hosts.find(host->first));
+                        continue;
+                    }
+                    const verdict v = std::invoke(f, line.front());
+                    if ( v == verdict::stop ) {
+                        return;
+                    }
+                    blocked = v == verdict::taken ? 0u : blocked + 1u;
+                    lvl->round.push_back(host);
+                    lvl->round.pop_front();
+                }
+            }
+        }
+
+        // visits the items in the order of their turns
+        template < typename F >
+        void for_each(F&& f) const {
+            for ( auto lvl = levels_.rbegin(); lvl != levels_.rend(); ++lvl ) {
+                for ( const host_entry* host : lvl->round ) {
+                    for ( const item_ptr& item : host->second ) {
+                        if ( item->is_queued() ) {
+                            std::invoke(f, item);
+                        }
+                    }
+                }
+            }
+        }
+
+        void clear() noexcept {
+            for ( level& lvl : levels_ ) {
+                for ( auto& [origin, line] : lvl.hosts ) {
+                    for ( const item_ptr& item : line ) {
+                        item->queued(false);
+                    }
+                }
+                lvl.hosts.clear();
+                lvl.round.clear();
+            }
+            size_ = 0u;
         }
     private:
-        std::deque<T> deque_;
+        // the nodes of the map never move, so the round points right into it
+        using host_map = std::unordered_map<std::string, std::deque<item_ptr>>;
+        using host_entry = typename host_map::value_type;
+
+        struct level final {
+            host_map hosts;
+            std::deque<host_entry*> round;
+        };
+
+        static std::size_t level_index_(const T& item) noexcept {
+            return static_cast<std::size_t>(item.priority());
+        }
     private:
-        mutable std::mutex mutex_;
-        mutable std::condition_variable cvar_;
+        std::array<level, 3u> levels_;
+        std::size_t size_{0u};
+    };
+
+    // blocked waiters share a few mutex and condvar slots picked by address,
+    // so waitable objects publish their state through atomics only
+    class parking_lot final {
+    public:
+        template < typename Pred, typename Wait >
+        static void park(const void* key, Pred&& pred, Wait&& wait) {
+            if ( pred() ) {
+                return;
+            }
+            slot& s = slot_for_(key);
+            ++s.waiters;
+            {
+                std::unique_lock<std::mutex> lock(s.mutex);
+                wait(s.cvar, lock, pred);
+            }
+            --s.waiters;
+        }
+
+        // must be called after the state checked by the waiters is published
+        static void unpark_all(const void* key) noexcept {
+            slot& s = slot_for_(key);
+            if ( s.waiters.load() > 0u ) {
+                {
+                    std::lock_guard<std::mutex> guard(s.mutex);
+                }
+                s.cvar.notify_all();
+            }
+        }
+    private:
+        struct slot {
+            std::mutex mutex;
+            std::condition_variable cvar;
+            std::atomic_size_t waiters{0u};
+        };
+
+        static constexpr std::size_t slot_count{64u};
+
+        static slot& slot_for_(const void* key) noexcept {
+            static slot slots[slot_count];
+            const auto address = reinterpret_cast<std::uintptr_t>(key);
+            return slots[(address / alignof(std::max_align_t)) % slot_count];
+        }
     };
 
+    time_point_t saturating_add(time_point_t tp, time_point_t::duration d) noexcept {
+        return tp < time_point_t::max() - d
+            ? tp + d
+            : time_point_t::max();
+    }
+
     slist_t make_header_slist(const headers_t& headers) {
         std::string header_builder;
         curl_slist* result = nullptr;
@@ -187,6 +505,24 @@ namespace
         return {result, &curl_slist_free_all};
     }
 
+    std::string_view url_origin(std::string_view url) noexcept {
+        const std::size_t scheme_end = url.find("://");
+        const std::size_t authority_begin = scheme_end != std::string_view::npos
+            ? scheme_end + 3u
+            : 0u;
+        return url.substr(0u, url.find_first_of("/?#", authority_begin));
+    }
+
+    const std::string& default_user_agent() {
+        static const std::string user_agent = [](){
+            const auto* vi = curl_version_info(CURLVERSION_NOW);
+            return vi && vi->version
+                ? std::string("cURL/").append(vi->version)
+                : std::string();
+        }();
+        return user_agent;
+    }
+
     std::string make_escaped_string(std::string_view s) {
         std::unique_ptr<char, decltype(&curl_free)> escaped_string{
             curl_easy_escape(nullptr, s.data(), static_cast<int>(s.size())),
@@ -229,946 +565,3082 @@ namespace
     using namespace curly_hpp;
 
     using req_state_t = std::shared_ptr<request::internal_state>;
-    std::vector<req_state_t> active_handles;
-    mt_queue<req_state_t> new_handles;
 
-    class curl_state final {
+    class handle_pool final {
     public:
-        template < typename F >
-        static std::invoke_result_t<F, CURLM*> with(F&& f) {
-            std::lock_guard<std::mutex> guard(mutex_);
-            if ( !self_ ) {
-                self_ = std::make_unique<curl_state>();
+        static constexpr std::size_t default_max_size{16u};
+    public:
+        curlh_t acquire() {
+            if ( !handles_.empty() ) {
+                curlh_t curlh = std::move(handles_.back());
+                handles_.pop_back();
+                return curlh;
+            }
+            curlh_t curlh{curl_easy_init(), &curl_easy_cleanup};
+            if ( !curlh ) {
+                throw exception("curly_hpp: failed to curl_easy_init");
             }
-            return std::invoke(std::forward<F>(f), self_->curlm_);
+            return curlh;
         }
-    public:
-        curl_state() {
-            if ( 0 != curl_global_init(CURL_GLOBAL_ALL) ) {
-                throw exception("curly_hpp: failed to curl_global_init");
+
+        // the handle must be already removed from its multi handle
+        void release(curlh_t curlh) noexcept {
+            if ( !curlh || handles_.size() >= max_size_.load() ) {
+                return;
             }
-            curlm_ = curl_multi_init();
-            if ( !curlm_ ) {
-                curl_global_cleanup();
-                throw exception("curly_hpp: failed to curl_multi_init");
+            try {
+                curl_easy_reset(curlh.get());
+                handles_.push_back(std::move(curlh));
+            } catch (...) {
+                // the handle is just destroyed
             }
         }
 
-        [[maybe_unused]]
-        ~curl_state() noexcept {
-            std::lock_guard<std::mutex> guard(mutex_);
-            curl_multi_cleanup(curlm_);
-            curl_global_cleanup();
+        std::size_t max_size() const noexcept {
+            return max_size_.load();
+        }
+
+        void max_size(std::size_t size) noexcept {
+            max_size_.store(size);
+        }
+
+        void shrink() noexcept {
+            while ( handles_.size() > max_size_.load() ) {
+                handles_.pop_back();
+            }
+        }
+
+        void clear() noexcept {
+            handles_.clear();
         }
     private:
-        CURLM* curlm_{nullptr};
-        static std::mutex mutex_;
-        static std::unique_ptr<curl_state> self_;
+        std::vector<curlh_t> handles_;
+        std::atomic_size_t max_size_{default_max_size};
     };
 
-    std::mutex curl_state::mutex_;
-    std::unique_ptr<curl_state> curl_state::self_;
-}
+    // resolver results and TLS sessions are shared by all shards of an engine,
+    // connections stay with the multi handle whose sockets they are polled by
+    class share_state final {
+    public:
+        share_state() {
+            curlsh_ = curl_share_init();
+            if ( !curlsh_ ) {
+                throw exception("curly_hpp: failed to curl_share_init");
+            }
+            if ( CURLSHE_OK != curl_share_setopt(curlsh_, CURLSHOPT_USERDATA, this)
+                || CURLSHE_OK != curl_share_setopt(curlsh_, CURLSHOPT_LOCKFUNC, &s_lock_callback_)
+                || CURLSHE_OK != curl_share_setopt(curlsh_, CURLSHOPT_UNLOCKFUNC, &s_unlock_callback_)
+                || CURLSHE_OK != curl_share_setopt(curlsh_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS)
+                || CURLSHE_OK != curl_share_setopt(curlsh_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) )
+            {
+                curl_share_cleanup(curlsh_);
+                throw exception("curly_hpp: failed to curl_share_setopt");
+            }
+        }
 
-// -----------------------------------------------------------------------------
-//
-// request
-//
-// -----------------------------------------------------------------------------
+        ~share_state() noexcept {
+            curl_share_cleanup(curlsh_);
+        }
 
-namespace curly_hpp
-{
-    class request::internal_state final {
-    public:
-        internal_state(request_builder&& rb)
-        : breq_(std::move(rb))
+        share_state(const share_state&) = delete;
+        share_state& operator=(const share_state&) = delete;
+
+        CURLSH* curlsh() const noexcept {
+            return curlsh_;
+        }
+    private:
+        static void s_lock_callback_(
+            CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr) noexcept
         {
-            if ( !breq_.uploader() ) {
-                breq_.uploader<default_uploader>(&breq_.content().data());
-            }
+            (void)handle;
+            (void)access;
+            auto* self = static_cast<share_state*>(userptr);
+            self->mutex_for_(data).lock();
+        }
 
-            if ( !breq_.downloader() ) {
-                breq_.downloader<default_downloader>(&response_content_);
-            }
+        static void s_unlock_callback_(
+            CURL* handle, curl_lock_data data, void* userptr) noexcept
+        {
+            (void)handle;
+            auto* self = static_cast<share_state*>(userptr);
+            self->mutex_for_(data).unlock();
+        }
 
-            if ( !breq_.progressor() ) {
-                breq_.progressor<default_progressor>();
+        std::mutex& mutex_for_(curl_lock_data data) noexcept {
+            const auto index = static_cast<std::size_t>(data);
+            return mutexes_[index < std::size(mutexes_) ? index : 0u];
+        }
+    private:
+        CURLSH* curlsh_{nullptr};
+        std::mutex mutexes_[CURL_LOCK_DATA_LAST];
+    };
+
+    // zero counts and times mean no limit
+    struct connection_options final {
+        std::size_t max_host_connections{0u};
+        std::size_t max_total_connections{0u};
+        std::size_t max_idle_connections{64u};
+        time_sec_t max_idle_time{60};
+        time_sec_t max_connection_lifetime{0};
+        bool multiplexing{true};
+    };
+
+    // refills at a fixed rate of tokens per second up to its burst
+    class rate_bucket final {
+    public:
+        bool try_take(double rate, double burst, time_point_t now) noexcept {
+            refill_(rate, burst, now);
+            if ( tokens_ < 1.0 ) {
+                return false;
             }
+            tokens_ -= 1.0;
+            return true;
         }
 
-        void enqueue(CURLM* curlm) {
-            std::lock_guard<std::mutex> guard(mutex_);
+        bool has_token(double rate, double burst, time_point_t now) noexcept {
+            refill_(rate, burst, now);
+            return tokens_ >= 1.0;
+        }
 
-            assert(!curlh_);
-            curlh_ = curlh_t{
-                curl_easy_init(),
-                &curl_easy_cleanup};
+        void give_back() noexcept {
+            tokens_ += 1.0;
+        }
 
-            if ( !curlh_ ) {
-                throw exception("curly_hpp: failed to curl_easy_init");
-            }
+        bool is_full(double rate, double burst, time_point_t now) noexcept {
+            refill_(rate, burst, now);
+            return tokens_ >= burst;
+        }
 
-            hlist_ = make_header_slist(breq_.headers());
-            url_with_qparams_ = make_escaped_url(breq_.url(), breq_.qparams());
+        time_point_t next_token(double rate, time_point_t now) const noexcept {
+            const std::chrono::duration<double> delay{(1.0 - tokens_) / rate};
+            return now + std::chrono::ceil<time_point_t::duration>(delay);
+        }
+    private:
+        void refill_(double rate, double burst, time_point_t now) noexcept {
+            // a new bucket starts from the clock epoch, so it's full
+            const std::chrono::duration<double> elapsed = now - last_;
+            tokens_ = std::min(burst, tokens_ + elapsed.count() * rate);
+            last_ = now;
+        }
+    private:
+        double tokens_{0.0};
+        time_point_t last_{};
+    };
 
-            if ( const auto* vi = curl_version_info(CURLVERSION_NOW); vi && vi->version ) {
-                std::string user_agent("cURL/");
-                user_agent.append(vi->version);
-                curl_easy_setopt(curlh_.get(), CURLOPT_USERAGENT, user_agent.c_str());
-            }
+    // engine wide limits of running transfers and of requests waiting
+    // for them, zero means no limit
+    class admission_state final {
+    public:
+        std::size_t max_active() const noexcept {
+            return max_active_.load();
+        }
 
-            curl_easy_setopt(curlh_.get(), CURLOPT_NOSIGNAL, 1l);
-            curl_easy_setopt(curlh_.get(), CURLOPT_PRIVATE, this);
-            curl_easy_setopt(curlh_.get(), CURLOPT_TCP_KEEPALIVE, 1l);
-            curl_easy_setopt(curlh_.get(), CURLOPT_BUFFERSIZE, 65536l);
-            curl_easy_setopt(curlh_.get(), CURLOPT_USE_SSL, CURLUSESSL_ALL);
-            curl_easy_setopt(curlh_.get(), CURLOPT_ERRORBUFFER, error_buffer_);
+        void max_active(std::size_t count) noexcept {
+            max_active_.store(count);
+            ++limits_version_;
+        }
 
-            curl_easy_setopt(curlh_.get(), CURLOPT_READDATA, this);
-            curl_easy_setopt(curlh_.get(), CURLOPT_READFUNCTION, &s_upload_callback_);
+        std::size_t max_host_active() const noexcept {
+            return max_host_active_.load();
+        }
 
-            curl_easy_setopt(curlh_.get(), CURLOPT_WRITEDATA, this);
-            curl_easy_setopt(curlh_.get(), CURLOPT_WRITEFUNCTION, &s_download_callback_);
+        void max_host_active(std::size_t count) noexcept {
+            max_host_active_.store(count);
+            ++limits_version_;
+        }
 
-            curl_easy_setopt(curlh_.get(), CURLOPT_NOPROGRESS, 0l);
-            curl_easy_setopt(curlh_.get(), CURLOPT_XFERINFODATA, this);
-            curl_easy_setopt(curlh_.get(), CURLOPT_XFERINFOFUNCTION, &s_progress_callback_);
+        double max_rate() const noexcept {
+            return max_rate_.load();
+        }
 
-            curl_easy_setopt(curlh_.get(), CURLOPT_HEADERDATA, this);
-            curl_easy_setopt(curlh_.get(), CURLOPT_HEADERFUNCTION, &s_header_callback_);
+        void max_rate(double rate) noexcept {
+            max_rate_.store(rate);
+            ++limits_version_;
+        }
 
-            curl_easy_setopt(curlh_.get(), CURLOPT_URL, url_with_qparams_.c_str());
-            curl_easy_setopt(curlh_.get(), CURLOPT_HTTPHEADER, hlist_.get());
-            curl_easy_setopt(curlh_.get(), CURLOPT_VERBOSE, breq_.verbose() ? 1l : 0l);
+        double max_host_rate() const noexcept {
+            return max_host_rate_.load();
+        }
 
-            switch ( breq_.method() ) {
-            case http_method::DEL:
-                curl_easy_setopt(curlh_.get(), CURLOPT_CUSTOMREQUEST, "DELETE");
-                curl_easy_setopt(curlh_.get(), CURLOPT_POST, 1l);
-                curl_easy_setopt(curlh_.get(), CURLOPT_POSTFIELDSIZE_LARGE,
-                    static_cast<curl_off_t>(breq_.uploader()->size()));
-                break;
-            case http_method::PUT:
-                curl_easy_setopt(curlh_.get(), CURLOPT_UPLOAD, 1l);
-                curl_easy_setopt(curlh_.get(), CURLOPT_INFILESIZE_LARGE,
-                    static_cast<curl_off_t>(breq_.uploader()->size()));
-                break;
-            case http_method::GET:
-                curl_easy_setopt(curlh_.get(), CURLOPT_HTTPGET, 1l);
-                break;
-            case http_method::HEAD:
-                curl_easy_setopt(curlh_.get(), CURLOPT_NOBODY, 1l);
-                break;
-            case http_method::POST:
-                curl_easy_setopt(curlh_.get(), CURLOPT_POST, 1l);
-                curl_easy_setopt(curlh_.get(), CURLOPT_POSTFIELDSIZE_LARGE,
-                    static_cast<curl_off_t>(breq_.uploader()->size()));
-                break;
-            case http_method::PATCH:
-                curl_easy_setopt(curlh_.get(), CURLOPT_CUSTOMREQUEST, "PATCH");
-                curl_easy_setopt(curlh_.get(), CURLOPT_UPLOAD, 1l);
-                curl_easy_setopt(curlh_.get(), CURLOPT_INFILESIZE_LARGE,
-                    static_cast<curl_off_t>(breq_.uploader()->size()));
-                break;
-            case http_method::OPTIONS:
-                curl_easy_setopt(curlh_.get(), CURLOPT_CUSTOMREQUEST, "OPTIONS");
-                curl_easy_setopt(curlh_.get(), CURLOPT_NOBODY, 1l);
-                break;
-            default:
-                throw exception("curly_hpp: unexpected request method");
-            }
+        void max_host_rate(double rate) noexcept {
+            max_host_rate_.store(rate);
+            ++limits_version_;
+        }
 
-            if ( breq_.verification() ) {
-                curl_easy_setopt(curlh_.get(), CURLOPT_SSL_VERIFYPEER, 1l);
-                curl_easy_setopt(curlh_.get(), CURLOPT_SSL_VERIFYHOST, 2l);
-            } else {
-                curl_easy_setopt(curlh_.get(), CURLOPT_SSL_VERIFYPEER, 0l);
-                curl_easy_setopt(curlh_.get(), CURLOPT_SSL_VERIFYHOST, 0l);
-            }
+        std::size_t max_burst() const noexcept {
+            return max_burst_.load();
+        }
 
-            if ( breq_.redirections() ) {
-                curl_easy_setopt(curlh_.get(), CURLOPT_FOLLOWLOCATION, 1l);
-                curl_easy_setopt(curlh_.get(), CURLOPT_MAXREDIRS,
-                    static_cast<long>(breq_.redirections()));
-            } else {
-                curl_easy_setopt(curlh_.get(), CURLOPT_FOLLOWLOCATION, 0l);
-            }
+        void max_burst(std::size_t burst) noexcept {
+            max_burst_.store(std::max(burst, std::size_t(1u)));
+            ++limits_version_;
+        }
 
-            curl_easy_setopt(curlh_.get(), CURLOPT_TIMEOUT_MS,
-                static_cast<long>(std::max(time_ms_t(1), breq_.request_timeout()).count()));
+        // changes with every limit, so the shards know to look at their queues again
+        std::size_t limits_version() const noexcept {
+            return limits_version_.load();
+        }
 
-            curl_easy_setopt(curlh_.get(), CURLOPT_CONNECTTIMEOUT_MS,
-                static_cast<long>(std::max(time_ms_t(1), breq_.connection_timeout()).count()));
+        // nothing is admitted while any drain is running
+        void begin_drain() noexcept {
+            ++drains_;
+        }
 
-            last_response_ = time_point_t::clock::now();
-            response_timeout_ = std::max(time_ms_t(1), breq_.response_timeout());
+        void end_drain() noexcept {
+            --drains_;
+        }
 
-            if ( CURLM_OK != curl_multi_add_handle(curlm, curlh_.get()) ) {
-                throw exception("curly_hpp: failed to curl_multi_add_handle");
-            }
+        bool is_draining() const noexcept {
+            return drains_.load() > 0u;
         }
 
-        void dequeue(CURLM* curlm) noexcept {
-            std::lock_guard<std::mutex> guard(mutex_);
-            if ( curlh_ ) {
-                curl_easy_setopt(curlh_.get(), CURLOPT_PRIVATE, nullptr);
+        bool has_limits() const noexcept {
+            return max_active_.load() > 0u
+                || max_host_active_.load() > 0u
+                || max_rate_.load() > 0.0
+                || max_host_rate_.load() > 0.0;
+        }
 
-                curl_easy_setopt(curlh_.get(), CURLOPT_READDATA, nullptr);
-                curl_easy_setopt(curlh_.get(), CURLOPT_READFUNCTION, nullptr);
+        // on failure, tells when the next token is due
+        bool try_take_rate_token(time_point_t now, time_point_t& next) {
+            const double rate = max_rate_.load();
+            if ( rate <= 0.0 ) {
+                return true;
+            }
+            std::lock_guard<std::mutex> guard(rate_mutex_);
+            if ( rate_bucket_.try_take(rate, static_cast<double>(max_burst_.load()), now) ) {
+                return true;
+            }
+            next = rate_bucket_.next_token(rate, now);
+            return false;
+        }
 
-                curl_easy_setopt(curlh_.get(), CURLOPT_WRITEDATA, nullptr);
-                curl_easy_setopt(curlh_.get(), CURLOPT_WRITEFUNCTION, nullptr);
+        void give_back_rate_token() {
+            if ( max_rate_.load() > 0.0 ) {
+                std::lock_guard<std::mutex> guard(rate_mutex_);
+                rate_bucket_.give_back();
+            }
+        }
 
-                curl_easy_setopt(curlh_.get(), CURLOPT_NOPROGRESS, 1l);
-                curl_easy_setopt(curlh_.get(), CURLOPT_XFERINFODATA, nullptr);
-                curl_easy_setopt(curlh_.get(), CURLOPT_XFERINFOFUNCTION, nullptr);
+        std::size_t max_queued() const noexcept {
+            return max_queued_.load();
+        }
 
-                curl_easy_setopt(curlh_.get(), CURLOPT_HEADERDATA, nullptr);
-                curl_easy_setopt(curlh_.get(), CURLOPT_HEADERFUNCTION, nullptr);
+        void max_queued(std::size_t count) noexcept {
+            max_queued_.store(count);
+            notify_producers_();
+        }
 
-                curl_multi_remove_handle(curlm, curlh_.get());
-                curlh_.reset();
-            }
+        bool has_active_room() const noexcept {
+            const std::size_t max = max_active_.load();
+            return max == 0u || active_.load() < max;
         }
 
-        bool done() noexcept {
-            std::lock_guard<std::mutex> guard(mutex_);
-            if ( status_ != req_status::pending ) {
+        bool try_acquire_active() noexcept {
+            const std::size_t max = max_active_.load();
+            std::size_t active = active_.load();
+            do {
+                if ( max > 0u && active >= max ) {
+                    starved_.store(true);
+                    return false;
+                }
+            } while ( !active_.compare_exchange_weak(active, active + 1u) );
+            return true;
+        }
+
+        // returns whether some shard has been left with requests it couldn't admit
+        bool release_active(std::size_t count) noexcept {
+            if ( count == 0u ) {
                 return false;
             }
+            active_.fetch_sub(count);
+            return starved_.exchange(false);
+        }
 
-            char* last_url = nullptr;
-            if ( CURLE_OK != curl_easy_getinfo(
-                curlh_.get(),
-                CURLINFO_EFFECTIVE_URL,
-                &last_url) || !last_url )
-            {
-                status_ = req_status::failed;
-                cvar_.notify_all();
-                return false;
+        // a whole batch is let in as soon as the queue has any room,
+        // so batches larger than the limit don't wait forever
+        bool try_acquire_queued(std::size_t count) noexcept {
+            const std::size_t max = max_queued_.load();
+            std::size_t queued = queued_.load();
+            do {
+                if ( max > 0u && queued >= max ) {
+                    return false;
+                }
+            } while ( !queued_.compare_exchange_weak(queued, queued + count) );
+            return true;
+        }
+
+        void acquire_queued(std::size_t count) {
+            if ( try_acquire_queued(count) ) {
+                return;
             }
+            std::unique_lock<std::mutex> lock(mutex_);
+            const waiter_guard guard{waiters_};
+            cvar_.wait(lock, [this, count](){
+                return try_acquire_queued(count);
+            });
+        }
 
-            long http_code = 0;
-            if ( CURLE_OK != curl_easy_getinfo(
-                curlh_.get(),
-                CURLINFO_RESPONSE_CODE,
-                &http_code) || !http_code )
-            {
-                status_ = req_status::failed;
-                cvar_.notify_all();
-                return false;
+        bool acquire_queued_until(std::size_t count, time_point_t tp) {
+            if ( try_acquire_queued(count) ) {
+                return true;
             }
+            std::unique_lock<std::mutex> lock(mutex_);
+            const waiter_guard guard{waiters_};
+            return cvar_.wait_until(lock, tp, [this, count](){
+                return try_acquire_queued(count);
+            });
+        }
 
-            try {
-                response_ = response(last_url, static_cast<http_code_t>(http_code));
-                response_.content = std::move(response_content_);
-                response_.headers = std::move(response_headers_);
-                response_.uploader = std::move(breq_.uploader());
-                response_.downloader = std::move(breq_.downloader());
-                response_.progressor = std::move(breq_.progressor());
-            } catch (...) {
-                status_ = req_status::failed;
+        void release_queued(std::size_t count) noexcept {
+            if ( count > 0u ) {
+                queued_.fetch_sub(count);
+                notify_producers_();
+            }
+        }
+    private:
+        struct waiter_guard final {
+            std::atomic_size_t& waiters;
+            explicit waiter_guard(std::atomic_size_t& w) noexcept
+            : waiters(w) { ++waiters; }
+            ~waiter_guard() noexcept { --waiters; }
+        };
+
+        void notify_producers_() noexcept {
+            if ( waiters_.load() > 0u ) {
+                // a producer between its check and its wait holds the mutex
+                { std::lock_guard<std::mutex> guard(mutex_); }
                 cvar_.notify_all();
-                return false;
             }
-
-            progress_ = 1.f;
-            status_ = req_status::done;
-            error_.clear();
-
-            cvar_.notify_all();
-            return true;
         }
+    private:
+        std::atomic_size_t active_{0u};
+        std::atomic_size_t queued_{0u};
+        std::atomic_size_t max_active_{0u};
+        std::atomic_size_t max_host_active_{0u};
+        std::atomic_size_t max_queued_{0u};
+        std::atomic<bool> starved_{false};
+        std::atomic_size_t drains_{0u};
+        std::atomic_size_t limits_version_{0u};
+    private:
+        std::atomic<double> max_rate_{0.0};
+        std::atomic<double> max_host_rate_{0.0};
+        std::atomic_size_t max_burst_{1u};
+        std::mutex rate_mutex_;
+        rate_bucket rate_bucket_;
+    private:
+        std::mutex mutex_;
+        std::condition_variable cvar_;
+        std::atomic_size_t waiters_{0u};
+    };
 
-        bool fail(CURLcode err) noexcept {
-            std::lock_guard<std::mutex> guard(mutex_);
-            if ( status_ != req_status::pending ) {
-                return false;
+    class shard_state final {
+    public:
+        shard_state(
+            std::shared_ptr<share_state> share,
+            std::shared_ptr<admission_state> admission)
+        : share_(std::move(share))
+        , admission_(std::move(admission))
+        {
+            curlm_ = curl_multi_init();
+            if ( !curlm_ ) {
+                throw exception("curly_hpp: failed to curl_multi_init");
             }
-
-            try {
-                switch ( err ) {
-                case CURLE_OPERATION_TIMEDOUT:
-                    status_ = req_status::timeout;
-                    error_.assign("Operation timeout");
-                    break;
-                case CURLE_READ_ERROR:
-                case CURLE_WRITE_ERROR:
-                case CURLE_ABORTED_BY_CALLBACK:
-                    status_ = req_status::cancelled;
-                    error_.assign("Callback aborted");
-                    break;
-                default:
-                    status_ = req_status::failed;
-                    error_.assign(error_buffer_[0]
-                        ? error_buffer_
-                        : "Unknown error");
-                    break;
+        #if defined(__linux__)
+            epollfd_ = epoll_create1(EPOLL_CLOEXEC);
+            if ( epollfd_ < 0 ) {
+                curl_multi_cleanup(curlm_);
+                throw exception("curly_hpp: failed to epoll_create1");
+            }
+            wakeupfd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            epoll_event wakeup_event{};
+            wakeup_event.events = EPOLLIN;
+            wakeup_event.data.fd = wakeupfd_;
+            if ( wakeupfd_ < 0 || 0 != epoll_ctl(epollfd_, EPOLL_CTL_ADD, wakeupfd_, &wakeup_event) ) {
+                if ( wakeupfd_ >= 0 ) {
+                    close(wakeupfd_);
                 }
-            } catch (...) {
-                status_ = req_status::failed;
-                cvar_.notify_all();
-                return true;
+                close(epollfd_);
+                curl_multi_cleanup(curlm_);
+                throw exception("curly_hpp: failed to eventfd");
             }
+            curl_multi_setopt(curlm_, CURLMOPT_SOCKETDATA, this);
+            curl_multi_setopt(curlm_, CURLMOPT_SOCKETFUNCTION, &s_socket_callback_);
+            curl_multi_setopt(curlm_, CURLMOPT_TIMERDATA, this);
+            curl_multi_setopt(curlm_, CURLMOPT_TIMERFUNCTION, &s_timer_callback_);
+        #endif
+        }
 
-            cvar_.notify_all();
-            return true;
+        ~shard_state() noexcept {
+            curl_multi_cleanup(curlm_);
+            // pooled handles still use the share, so they go first
+            easy_handles.clear();
+        #if defined(__linux__)
+            close(wakeupfd_);
+            close(epollfd_);
+        #endif
         }
 
-        bool cancel() noexcept {
-            std::lock_guard<std::mutex> guard(mutex_);
-            if ( status_ != req_status::pending ) {
-                return false;
+        shard_state(const shard_state&) = delete;
+        shard_state& operator=(const shard_state&) = delete;
+
+        // owns the multi handle, the timeouts and everything that runs
+        // transfers, so user handlers are only ever called under this one
+        template < typename F >
+        std::invoke_result_t<F, shard_state&> with(F&& f) {
+            std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+            if ( !lock.owns_lock() ) {
+                // the owner may be parked in wait(), so kick it out first
+                ++contenders_;
+                wakeup();
+                lock.lock();
+                --contenders_;
             }
+            return std::invoke(std::forward<F>(f), *this);
+        }
 
-            try {
-                status_ = req_status::cancelled;
-                error_.assign("Operation cancelled");
-            } catch (...) {
-                status_ = req_status::failed;
-                cvar_.notify_all();
-                return true;
+        // guards the handle lists only, transfers and their handlers run without it,
+        // but curl adds and removes handles under it, so the loop hooks may be called
+        template < typename F >
+        std::invoke_result_t<F, shard_state&> with_handles(F&& f) {
+            std::lock_guard<std::mutex> guard(handles_mutex_);
+            return std::invoke(std::forward<F>(f), *this);
+        }
+
+        void wakeup() noexcept {
+            if ( external_.load() ) {
+                // a burst of producers costs the host loop a single wakeup
+                if ( !loop_wakeup_.exchange(true) ) {
+                    try {
+                        loop_.wakeup();
+                    } catch (...) {
+                        loop_wakeup_.store(false);
+                    }
+                }
+                return;
             }
+        #if defined(__linux__)
+            const std::uint64_t wakeups = 1;
+            [[maybe_unused]] const auto written = write(wakeupfd_, &wakeups, sizeof(wakeups));
+        #else
+            curl_multi_wakeup(curlm_);
+        #endif
+        }
 
-            cvar_.notify_all();
-            return true;
+        CURLM* curlm() const noexcept {
+            return curlm_;
         }
 
-        float progress() const noexcept {
-            std::lock_guard<std::mutex> guard(mutex_);
-            return progress_;
+        CURLSH* curlsh() const noexcept {
+            return share_->curlsh();
         }
 
-        req_status status() const noexcept {
-            std::lock_guard<std::mutex> guard(mutex_);
-            return status_;
+        admission_state& admission() const noexcept {
+            return *admission_;
         }
 
-        bool is_done() const noexcept {
-            std::lock_guard<std::mutex> guard(mutex_);
-            return status_ == req_status::done;
+        // multi handle options, so it must be called under the shard lock
+        void connections(const connection_options& options) noexcept {
+            const auto as_long = [](std::size_t count){
+                return static_cast<long>(std::min(
+                    count,
+                    static_cast<std::size_t>(std::numeric_limits<long>::max())));
+            };
+            curl_multi_setopt(curlm_, CURLMOPT_MAX_HOST_CONNECTIONS,
+                as_long(options.max_host_connections));
+            curl_multi_setopt(curlm_, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                as_long(options.max_total_connections));
+            // without an explicit size the cache shrinks with the number of transfers
+            curl_multi_setopt(curlm_, CURLMOPT_MAXCONNECTS,
+                as_long(options.max_idle_connections));
+            curl_multi_setopt(curlm_, CURLMOPT_PIPELINING,
+                options.multiplexing ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+            connections_ = options;
         }
 
-        bool is_pending() const noexcept {
-            std::lock_guard<std::mutex> guard(mutex_);
-            return status_ == req_status::pending;
+        const connection_options& connections() const noexcept {
+            return connections_;
         }
 
-        req_status wait(bool wait_callback) const noexcept {
-            std::unique_lock<std::mutex> lock(mutex_);
-            cvar_.wait(lock, [this, wait_callback](){
-                return (status_ != req_status::pending)
-                    && (!wait_callback || callbacked_);
-            });
-            return status_;
+        // the host loop takes over the sockets and the timer,
+        // so it must be called under the shard lock
+        void attach_loop(loop_hooks hooks) {
+            loop_ = std::move(hooks);
+        #if !defined(__linux__)
+            curl_multi_setopt(curlm_, CURLMOPT_SOCKETDATA, this);
+            curl_multi_setopt(curlm_, CURLMOPT_SOCKETFUNCTION, &s_socket_callback_);
+            curl_multi_setopt(curlm_, CURLMOPT_TIMERDATA, this);
+            curl_multi_setopt(curlm_, CURLMOPT_TIMERFUNCTION, &s_timer_callback_);
+        #endif
+            external_.store(true);
         }
 
-        req_status wait_for(time_ms_t ms, bool wait_callback) const noexcept {
-            std::unique_lock<std::mutex> lock(mutex_);
-            cvar_.wait_for(lock, ms, [this, wait_callback](){
-                return (status_ != req_status::pending)
-                    && (!wait_callback || callbacked_);
-            });
-            return status_;
+        bool is_external() const noexcept {
+            return external_.load();
         }
 
-        req_status wait_until(time_point_t tp, bool wait_callback) const noexcept {
-            std::unique_lock<std::mutex> lock(mutex_);
-            cvar_.wait_until(lock, tp, [this, wait_callback](){
-                return (status_ != req_status::pending)
-                    && (!wait_callback || callbacked_);
-            });
-            return status_;
+        void socket_action(curl_socket_t s, int ev_bitmask) {
+            int running_handles = 0;
+            if ( CURLM_OK != curl_multi_socket_action(curlm_, s, ev_bitmask, &running_handles) ) {
+                throw exception("curly_hpp: failed to curl_multi_socket_action");
+            }
         }
 
-        response take() {
-            std::unique_lock<std::mutex> lock(mutex_);
-            cvar_.wait(lock, [this](){
-                return status_ != req_status::pending;
-            });
-            if ( status_ != req_status::done ) {
-                throw exception("curly_hpp: response is unavailable");
+        // returns whether the libcurl timer has expired
+        bool expire_timer() {
+            if ( time_point_t::clock::now() < timer_deadline_ ) {
+                return false;
             }
-            status_ = req_status::empty;
-            return std::move(response_);
+            timer_deadline_ = time_point_t::max();
+            socket_action(CURL_SOCKET_TIMEOUT, 0);
+            return true;
         }
 
-        const std::string& get_error() const noexcept {
-            std::unique_lock<std::mutex> lock(mutex_);
-            cvar_.wait(lock, [this](){
-                return status_ != req_status::pending;
-            });
-            return error_;
+        void clear_loop_wakeup() noexcept {
+            loop_wakeup_.store(false);
         }
 
-        std::exception_ptr get_callback_exception() const noexcept {
-            std::unique_lock<std::mutex> lock(mutex_);
-            cvar_.wait(lock, [this](){
-                return callbacked_;
-            });
-            return callback_exception_;
+        // the timer of the host loop is one-shot, so once it has fired
+        // the next deadline is handed over even if it's the same
+        void forget_loop_timer() noexcept {
+            loop_deadline_ = time_point_t::max();
         }
 
-        template < typename... Args >
-        void call_callback(Args&&... args) noexcept {
-            try {
-                if ( breq_.callback() ) {
-                    breq_.callback()(std::forward<Args>(args)...);
+        void sync_loop_timer(time_point_t deadline) {
+            deadline = std::min(deadline, timer_deadline_);
+            if ( deadline != loop_deadline_ ) {
+                loop_deadline_ = deadline;
+                loop_.timer(deadline);
+            }
+        }
+
+        // returns whether any socket or timer has been serviced
+        bool perform() {
+        #if defined(__linux__)
+            // only sockets reported by epoll and an expired libcurl timer
+            // are serviced, so idle transfers cost nothing per tick
+            bool serviced = false;
+            epoll_event events[max_epoll_events];
+            const int nevents = epoll_wait(epollfd_, events, max_epoll_events, 0);
+            for ( int i = 0; i < nevents; ++i ) {
+                if ( events[i].data.fd == wakeupfd_ ) {
+                    continue;
                 }
-            } catch (...) {
-                std::lock_guard<std::mutex> guard(mutex_);
-                callback_exception_ = std::current_exception();
+                int ev_bitmask = 0;
+                if ( events[i].events & EPOLLIN ) {
+                    ev_bitmask |= CURL_CSELECT_IN;
+                }
+                if ( events[i].events & EPOLLOUT ) {
+                    ev_bitmask |= CURL_CSELECT_OUT;
+                }
+                if ( events[i].events & (EPOLLERR | EPOLLHUP) ) {
+                    ev_bitmask |= CURL_CSELECT_ERR;
+                }
+                serviced = true;
+                socket_action(static_cast<curl_socket_t>(events[i].data.fd), ev_bitmask);
             }
-            std::lock_guard<std::mutex> guard(mutex_);
-            assert(!callbacked_ && status_ != req_status::pending);
-            callbacked_ = true;
-            cvar_.notify_all();
+            return expire_timer() || serviced;
+        #else
+            // curl_multi_perform doesn't tell whether anything has happened
+            int running_handles = 0;
+            if ( CURLM_OK != curl_multi_perform(curlm_, &running_handles) ) {
+                throw exception("curly_hpp: failed to curl_multi_perform");
+            }
+            return false;
+        #endif
         }
 
-        bool check_response_timeout(time_point_t now) const noexcept {
-            std::lock_guard<std::mutex> guard(mutex_);
-            return now - last_response_ >= response_timeout_;
+        void wait(time_ms_t ms) {
+            if ( contenders_.load() > 0 ) {
+                // don't park with the lock while someone is waiting for it
+                return;
+            }
+            parked_.store(true);
+            if ( has_new_handles() ) {
+                // a producer may have missed the parked flag
+                parked_.store(false);
+                return;
+            }
+            const parked_guard guard{parked_};
+            const int timeout_ms = static_cast<int>(std::min(
+                ms.count(),
+                static_cast<time_ms_t::rep>(std::numeric_limits<int>::max())));
+        #if defined(__linux__)
+            int epoll_timeout_ms = timeout_ms;
+            if ( timer_deadline_ != time_point_t::max() ) {
+                const auto timer_ms = std::chrono::ceil<time_ms_t>(
+                    timer_deadline_ - time_point_t::clock::now());
+                epoll_timeout_ms = static_cast<int>(std::clamp(
+                    timer_ms.count(),
+                    time_ms_t::rep(0),
+                    static_cast<time_ms_t::rep>(timeout_ms)));
+            }
+            epoll_event event;
+            if ( -1 == epoll_wait(epollfd_, &event, 1, epoll_timeout_ms) ) {
+                if ( errno != EINTR ) {
+                    throw exception("curly_hpp: failed to epoll_wait");
+                }
+            }
+            std::uint64_t wakeups = 0;
+            while ( read(wakeupfd_, &wakeups, sizeof(wakeups)) > 0 ) {}
+        #else
+            if ( CURLM_OK != curl_multi_poll(curlm_, nullptr, 0, timeout_ms, nullptr) ) {
+                throw exception("curly_hpp: failed to curl_multi_poll");
+            }
+        #endif
         }
-    private:
-        static std::size_t s_upload_callback_(
-            char* buffer, std::size_t size, std::size_t nitems, void* userdata) noexcept
-        {
-            auto* self = static_cast<internal_state*>(userdata);
-            return self->upload_callback_(buffer, size * nitems);
+        // producers only wake a performer that is actually parked in wait()
+        void notify() noexcept {
+            if ( parked_.load() || external_.load() ) {
+                wakeup();
+            }
         }
 
-        static std::size_t s_download_callback_(
-            char* ptr, std::size_t size, std::size_t nmemb, void* userdata) noexcept
-        {
-            auto* self = static_cast<internal_state*>(userdata);
-            return self->download_callback_(ptr, size * nmemb);
+        bool has_new_handles() const noexcept {
+            if ( !new_handles.empty() ) {
+                return true;
+            }
+            // requests held back by the limits don't count,
+            // or the performer would never park while they wait
+            std::lock_guard<std::mutex> guard(handles_mutex_);
+            return queued_unseen || (queued_starved && admission_->has_active_room());
         }
 
-        static int s_progress_callback_(
-            void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) noexcept
-        {
-            auto* self = static_cast<internal_state*>(clientp);
-            return self->progress_callback(dlnow, dltotal, ulnow, ultotal);
+        // transfers of every host, so it must be called under the handles lock
+        std::size_t host_transfers(const std::string& origin) const noexcept {
+            const auto iter = host_transfers_.find(origin);
+            return iter != host_transfers_.end() ? iter->second : 0u;
         }
 
-        static std::size_t s_header_callback_(
-            char* buffer, std::size_t size, std::size_t nitems, void* userdata) noexcept
-        {
-            auto* self = static_cast<internal_state*>(userdata);
-            return self->header_callback_(buffer, size * nitems);
+        void acquire_host(const std::string& origin) {
+            ++host_transfers_[origin];
         }
-    private:
-        std::size_t upload_callback_(char* dst, std::size_t size) noexcept {
-            try {
+
+        void release_host(const std::string& origin) noexcept {
+            const auto iter = host_transfers_.find(origin);
+            if ( iter != host_transfers_.end() && 0u == --iter->second ) {
+                host_transfers_.erase(iter);
+            }
+        }
+
+        void clear_hosts() noexcept {
+            host_transfers_.clear();
+        }
+
+        rate_bucket& host_bucket(const std::string& origin) {
+            return host_buckets_[origin];
+        }
+
+        // buckets of hosts that have been quiet long enough are just like new ones
+        void trim_host_buckets(double rate, double burst, time_point_t now) noexcept {
+            if ( host_buckets_.size() < max_host_buckets ) {
+                return;
+            }
+            for ( auto iter = host_buckets_.begin(); iter != host_buckets_.end(); ) {
+                iter = iter->second.is_full(rate, burst, now)
+                    ? host_buckets_.erase(iter)
+                    : std::next(iter);
+            }
+        }
+    public:
+        std::vector<req_state_t> active_handles;
+        admission_queue<request::internal_state> queued_handles;
+        std::vector<req_state_t> queued_batch;
+        mpsc_queue<req_state_t> new_handles;
+    public:
+        // whether the admission hasn't looked at some queued requests yet,
+        // and whether the ones it has left wait for the active limit
+        bool queued_unseen{false};
+        bool queued_starved{false};
+        // the limits the admission has last looked at
+        std::size_t queued_limits{0u};
+        // when the rate limits let the queued requests go next
+        time_point_t queued_deadline{time_point_t::max()};
+    public:
+        std::vector<req_state_t> cancelled_batch;
+        mpsc_queue<req_state_t> cancelled_handles;
+    public:
+        timeout_heap<request::internal_state> response_timeouts;
+        // a request only waits in one of the heaps, so they share its fields
+        timeout_heap<request::internal_state> queued_timeouts;
+        handle_pool easy_handles;
+    private:
+        struct parked_guard final {
+            std::atomic<bool>& parked;
+            ~parked_guard() noexcept {
+                parked.store(false);
+            }
+        };
+    private:
+        static int s_socket_callback_(
+            CURL* easy, curl_socket_t s, int what, void* userp, void* socketp) noexcept
+        {
+            (void)easy;
+            (void)socketp;
+            auto* self = static_cast<shard_state*>(userp);
+            return self->socket_callback_(s, what);
+        }
+
+        static int s_timer_callback_(
+            CURLM* multi, long timeout_ms, void* userp) noexcept
+        {
+            (void)multi;
+            auto* self = static_cast<shard_state*>(userp);
+            return self->timer_callback_(timeout_ms);
+        }
+
+        int socket_callback_(curl_socket_t s, int what) noexcept {
+            if ( external_.load() ) {
+                socket_events events;
+                events.read = (what & CURL_POLL_IN) != 0;
+                events.write = (what & CURL_POLL_OUT) != 0;
+                try {
+                    loop_.watch(static_cast<socket_t>(s), events);
+                    return 0;
+                } catch (...) {
+                    return -1;
+                }
+            }
+        #if defined(__linux__)
+            if ( what == CURL_POLL_REMOVE ) {
+                epoll_ctl(epollfd_, EPOLL_CTL_DEL, s, nullptr);
+                return 0;
+            }
+
+            epoll_event event{};
+            event.data.fd = s;
+            event.events =
+                ((what & CURL_POLL_IN) ? EPOLLIN : 0u) |
+                ((what & CURL_POLL_OUT) ? EPOLLOUT : 0u);
+
+            if ( 0 == epoll_ctl(epollfd_, EPOLL_CTL_MOD, s, &event) ) {
+                return 0;
+            }
+
+            return errno == ENOENT && 0 == epoll_ctl(epollfd_, EPOLL_CTL_ADD, s, &event)
+                ? 0
+                : -1;
+        #else
+            return 0;
+        #endif
+        }
+
+        int timer_callback_(long timeout_ms) noexcept {
+            timer_deadline_ = timeout_ms < 0
+                ? time_point_t::max()
+                : time_point_t::clock::now() + time_ms_t(timeout_ms);
+            return 0;
+        }
+    private:
+        std::shared_ptr<share_state> share_;
+        std::shared_ptr<admission_state> admission_;
+        std::unordered_map<std::string, std::size_t> host_transfers_;
+        std::unordered_map<std::string, rate_bucket> host_buckets_;
+        static constexpr std::size_t max_host_buckets{256u};
+        connection_options connections_;
+        CURLM* curlm_{nullptr};
+        time_point_t timer_deadline_{time_point_t::max()};
+    #if defined(__linux__)
+        int epollfd_{-1};
+        int wakeupfd_{-1};
+        static constexpr int max_epoll_events{64};
+    #endif
+        loop_hooks loop_;
+        time_point_t loop_deadline_{time_point_t::max()};
+        std::atomic<bool> loop_wakeup_{false};
+        std::atomic<bool> external_{false};
+        std::mutex mutex_;
+        mutable std::mutex handles_mutex_;
+        std::atomic<bool> parked_{false};
+        std::atomic_size_t contenders_{0u};
+    };
+
+    class completion_buffer final {
+    public:
+        void push(const std::vector<req_state_t>& batch) {
+            if ( batch.empty() ) {
+                return;
+            }
+            {
                 std::lock_guard<std::mutex> guard(mutex_);
-                last_response_ = time_point_t::clock::now();
+                completions_.insert(completions_.end(), batch.begin(), batch.end());
+            }
+            cvar_.notify_all();
+        }
+
+        std::size_t poll(std::vector<request>& dst, std::size_t max) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            return pop_(dst, max);
+        }
+
+        std::size_t wait(std::vector<request>& dst, std::size_t max, time_ms_t ms) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cvar_.wait_for(lock, ms, [this](){
+                return !completions_.empty();
+            });
+            return pop_(dst, max);
+        }
+    private:
+        std::size_t pop_(std::vector<request>& dst, std::size_t max) {
+            const std::size_t count = std::min(max, completions_.size());
+            dst.reserve(dst.size() + count);
+            for ( std::size_t i = 0; i < count; ++i ) {
+                dst.emplace_back(std::move(completions_.front()));
+                completions_.pop_front();
+            }
+            return count;
+        }
+    private:
+        std::deque<req_state_t> completions_;
+        std::mutex mutex_;
+        std::condition_variable cvar_;
+    };
+
+    class curl_global_state final {
+    public:
+        static void ensure() {
+            static curl_global_state self;
+        }
+    public:
+        curl_global_state() {
+            if ( 0 != curl_global_init(CURL_GLOBAL_ALL) ) {
+                throw exception("curly_hpp: failed to curl_global_init");
+            }
+        }
+
+        [[maybe_unused]]
+        ~curl_global_state() noexcept {
+            curl_global_cleanup();
+        }
+    };
+}
+
+namespace curly_hpp
+{
+    class engine::internal_state final {
+    public:
+        explicit internal_state(std::size_t shards) {
+            curl_global_state::ensure();
+            share_ = std::make_shared<share_state>();
+            admission_ = std::make_shared<admission_state>();
+            shards_.reserve(shards);
+            for ( std::size_t i = 0; i < shards; ++i ) {
+                shards_.push_back(std::make_shared<shard_state>(share_, admission_));
+            }
+            update_connections([](connection_options&){});
+        }
+
+        std::size_t size() const noexcept {
+            return shards_.size();
+        }
+
+        shard_state& shard(std::size_t index) const noexcept {
+            assert(index < shards_.size());
+            return *shards_[index];
+        }
+
+        std::size_t shard_index_for(std::string_view url) const noexcept {
+            // requests to the same host land on the same shard,
+            // so its connection cache can be reused
+            return shards_.size() > 1u
+                ? std::hash<std::string_view>()(url_origin(url)) % shards_.size()
+                : 0u;
+        }
+
+        const std::shared_ptr<shard_state>& shard_for(std::string_view url) const noexcept {
+            return shards_[shard_index_for(url)];
+        }
+
+        const std::shared_ptr<shard_state>& shard_ptr(std::size_t index) const noexcept {
+            assert(index < shards_.size());
+            return shards_[index];
+        }
+
+        template < typename F >
+        void for_each_shard(F&& f) const {
+            for ( const auto& shard : shards_ ) {
+                shard->with([&f](shard_state& state){
+                    state.with_handles(f);
+                });
+            }
+        }
+
+        template < typename F >
+        void for_each_shard_handles(F&& f) const {
+            for ( const auto& shard : shards_ ) {
+                shard->with_handles(f);
+            }
+        }
+
+        void wakeup() const noexcept {
+            for ( const auto& shard : shards_ ) {
+                shard->wakeup();
+            }
+        }
+
+        executor_t executor() const {
+            std::lock_guard<std::mutex> guard(mutex_);
+            return executor_;
+        }
+
+        void executor(executor_t e) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            executor_ = std::move(e);
+        }
+
+        bool completions_enabled() const noexcept {
+            return completions_enabled_.load();
+        }
+
+        void completions_enabled(bool enable) noexcept {
+            completions_enabled_.store(enable);
+        }
+
+        completion_buffer& completions() const noexcept {
+            return completions_;
+        }
+
+        admission_state& admission() const noexcept {
+            return *admission_;
+        }
+
+        // an engine is driven either by one performer or by a host loop,
+        // two performers of a shard would only keep kicking each other out
+        void attach_performer() {
+            std::lock_guard<std::mutex> guard(mutex_);
+            if ( looped_ ) {
+                throw exception("curly_hpp: engine is already driven by a loop");
+            }
+            if ( performed_ ) {
+                throw exception("curly_hpp: engine is already driven by a performer");
+            }
+            performed_ = true;
+        }
+
+        void detach_performer() noexcept {
+            std::lock_guard<std::mutex> guard(mutex_);
+            performed_ = false;
+        }
+
+        void attach_loop(loop_hooks hooks) {
+            if ( !hooks.watch || !hooks.timer || !hooks.wakeup ) {
+                throw exception("curly_hpp: all loop hooks must be set");
+            }
+            if ( shards_.size() != 1u ) {
+                throw exception("curly_hpp: only single shard engines can be driven by a loop");
+            }
+            std::lock_guard<std::mutex> guard(mutex_);
+            if ( looped_ || performed_ ) {
+                throw exception("curly_hpp: engine is already driven");
+            }
+            shards_.front()->with([&hooks](shard_state& state){
+                // sockets of running transfers are already watched by the shard itself
+                if ( !state.with_handles(is_idle_) ) {
+                    throw exception("curly_hpp: engine with transfers can't be driven by a loop");
+                }
+                state.attach_loop(std::move(hooks));
+            });
+            looped_ = true;
+        }
+
+        shard_state& loop_shard() const {
+            if ( !shards_.front()->is_external() ) {
+                throw exception("curly_hpp: engine isn't driven by a loop");
+            }
+            return *shards_.front();
+        }
+
+        connection_options connections() const {
+            std::lock_guard<std::mutex> guard(mutex_);
+            return connections_;
+        }
+
+        template < typename F >
+        void update_connections(F&& f) {
+            std::lock_guard<std::mutex> guard(mutex_);
+            connection_options options = connections_;
+            std::invoke(std::forward<F>(f), options);
+
+            // engine wide counts are split between the shards
+            const auto per_shard = [this](std::size_t count){
+                return count > 0u
+                    ? std::max(count / shards_.size(), std::size_t(1u))
+                    : count;
+            };
+            connection_options shard_options = options;
+            shard_options.max_total_connections = per_shard(options.max_total_connections);
+            shard_options.max_idle_connections = per_shard(options.max_idle_connections);
+
+            for ( const auto& shard : shards_ ) {
+                shard->with([&shard_options](shard_state& state){
+                    state.connections(shard_options);
+                });
+            }
+            connections_ = options;
+        }
+    private:
+        std::shared_ptr<share_state> share_;
+        std::shared_ptr<admission_state> admission_;
+        std::vector<std::shared_ptr<shard_state>> shards_;
+    private:
+        static bool is_idle_(const shard_state& state) noexcept {
+            return state.active_handles.empty();
+        }
+    private:
+        executor_t executor_;
+        connection_options connections_;
+        mutable std::mutex mutex_;
+        bool performed_{false};
+        bool looped_{false};
+    private:
+        std::atomic<bool> completions_enabled_{false};
+        mutable completion_buffer completions_;
+    };
+}
+
+// -----------------------------------------------------------------------------
+//
+// request
+//
+// -----------------------------------------------------------------------------
+
+namespace curly_hpp
+{
+    class request::internal_state final
+        : public std::enable_shared_from_this<request::internal_state> {
+    public:
+        static constexpr std::size_t no_active_index{~std::size_t(0u)};
+    public:
+        internal_state(request_builder&& rb, std::weak_ptr<shard_state> shard)
+        : breq_(std::move(rb))
+        , shard_(std::move(shard))
+        , origin_(url_origin(breq_.url()))
+        {
+            if ( !breq_.uploader() ) {
+                breq_.uploader<default_uploader>(&breq_.content().data());
+            }
+
+            if ( !breq_.downloader() ) {
+                breq_.downloader<default_downloader>(&response_content_);
+            }
+
+            if ( !breq_.progressor() ) {
+                breq_.progressor<default_progressor>();
+            }
+        }
+
+        void enqueue(shard_state& shard) {
+            assert(!curlh_);
+            curlh_ = shard.easy_handles.acquire();
+
+            hlist_ = make_header_slist(breq_.headers());
+            url_with_qparams_ = make_escaped_url(breq_.url(), breq_.qparams());
+
+            if ( const std::string& user_agent = default_user_agent(); !user_agent.empty() ) {
+                curl_easy_setopt(curlh_.get(), CURLOPT_USERAGENT, user_agent.c_str());
+            }
+
+            curl_easy_setopt(curlh_.get(), CURLOPT_SHARE, shard.curlsh());
+            curl_easy_setopt(curlh_.get(), CURLOPT_NOSIGNAL, 1l);
+            curl_easy_setopt(curlh_.get(), CURLOPT_PRIVATE, this);
+            curl_easy_setopt(curlh_.get(), CURLOPT_TCP_KEEPALIVE, 1l);
+            if ( const time_sec_t max_idle_time = shard.connections().max_idle_time; max_idle_time.count() > 0 ) {
+                curl_easy_setopt(curlh_.get(), CURLOPT_MAXAGE_CONN,
+                    static_cast<long>(max_idle_time.count()));
+            } else {
+                curl_easy_setopt(curlh_.get(), CURLOPT_MAXAGE_CONN,
+                    std::numeric_limits<long>::max());
+            }
+        #if LIBCURL_VERSION_NUM >= 0x075000
+            curl_easy_setopt(curlh_.get(), CURLOPT_MAXLIFETIME_CONN,
+                static_cast<long>(shard.connections().max_connection_lifetime.count()));
+        #endif
+            curl_easy_setopt(curlh_.get(), CURLOPT_BUFFERSIZE, 65536l);
+            curl_easy_setopt(curlh_.get(), CURLOPT_USE_SSL, CURLUSESSL_ALL);
+            curl_easy_setopt(curlh_.get(), CURLOPT_ERRORBUFFER, error_buffer_);
+
+            curl_easy_setopt(curlh_.get(), CURLOPT_READDATA, this);
+            curl_easy_setopt(curlh_.get(), CURLOPT_READFUNCTION, &s_upload_callback_);
+
+            curl_easy_setopt(curlh_.get(), CURLOPT_WRITEDATA, this);
+            curl_easy_setopt(curlh_.get(), CURLOPT_WRITEFUNCTION, &s_download_callback_);
+
+            curl_easy_setopt(curlh_.get(), CURLOPT_NOPROGRESS, 0l);
+            curl_easy_setopt(curlh_.get(), CURLOPT_XFERINFODATA, this);
+            curl_easy_setopt(curlh_.get(), CURLOPT_XFERINFOFUNCTION, &s_progress_callback_);
+
+            curl_easy_setopt(curlh_.get(), CURLOPT_HEADERDATA, this);
+            curl_easy_setopt(curlh_.get(), CURLOPT_HEADERFUNCTION, &s_header_callback_);
+
+            curl_easy_setopt(curlh_.get(), CURLOPT_URL, url_with_qparams_.c_str());
+            curl_easy_setopt(curlh_.get(), CURLOPT_HTTPHEADER, hlist_.get());
+            curl_easy_setopt(curlh_.get(), CURLOPT_VERBOSE, breq_.verbose() ? 1l : 0l);
+
+            switch ( breq_.method() ) {
+            case http_method::DEL:
+                curl_easy_setopt(curlh_.get(), CURLOPT_CUSTOMREQUEST, "DELETE");
+                curl_easy_setopt(curlh_.get(), CURLOPT_POST, 1l);
+                curl_easy_setopt(curlh_.get(), CURLOPT_POSTFIELDSIZE_LARGE,
+                    static_cast<curl_off_t>(breq_.uploader()->size()));
+                break;
+            case http_method::PUT:
+                curl_easy_setopt(curlh_.get(), CURLOPT_UPLOAD, 1l);
+                curl_easy_setopt(curlh_.get(), CURLOPT_INFILESIZE_LARGE,
+                    static_cast<curl_off_t>(breq_.uploader()->size()));
+                break;
+            case http_method::GET:
+                curl_easy_setopt(curlh_.get(), CURLOPT_HTTPGET, 1l);
+                break;
+            case http_method::HEAD:
+                curl_easy_setopt(curlh_.get(), CURLOPT_NOBODY, 1l);
+                break;
+            case http_method::POST:
+                curl_easy_setopt(curlh_.get(), CURLOPT_POST, 1l);
+                curl_easy_setopt(curlh_.get(), CURLOPT_POSTFIELDSIZE_LARGE,
+                    static_cast<curl_off_t>(breq_.uploader()->size()));
+                break;
+            case http_method::PATCH:
+                curl_easy_setopt(curlh_.get(), CURLOPT_CUSTOMREQUEST, "PATCH");
+                curl_easy_setopt(curlh_.get(), CURLOPT_UPLOAD, 1l);
+                curl_easy_setopt(curlh_.get(), CURLOPT_INFILESIZE_LARGE,
+                    static_cast<curl_off_t>(breq_.uploader()->size()));
+                break;
+            case http_method::OPTIONS:
+                curl_easy_setopt(curlh_.get(), CURLOPT_CUSTOMREQUEST, "OPTIONS");
+                curl_easy_setopt(curlh_.get(), CURLOPT_NOBODY, 1l);
+                break;
+            default:
+                throw exception("curly_hpp: unexpected request method");
+            }
+
+            switch ( breq_.version() ) {
+            case http_version::any:
+                curl_easy_setopt(curlh_.get(), CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_NONE);
+                break;
+            case http_version::http1_1:
+                curl_easy_setopt(curlh_.get(), CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+                break;
+            case http_version::http2:
+                curl_easy_setopt(curlh_.get(), CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_0);
+                break;
+            case http_version::http2_tls:
+                curl_easy_setopt(curlh_.get(), CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+                break;
+            case http_version::http2_prior_knowledge:
+                curl_easy_setopt(curlh_.get(), CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+                break;
+            default:
+                throw exception("curly_hpp: unexpected request http version");
+            }
+
+            // waiting for a connection that can multiplex beats opening a new one
+            curl_easy_setopt(curlh_.get(), CURLOPT_PIPEWAIT, breq_.pipewait() ? 1l : 0l);
+            curl_easy_setopt(curlh_.get(), CURLOPT_STREAM_WEIGHT,
+                static_cast<long>(std::clamp(breq_.stream_weight(), std::uint16_t(1u), std::uint16_t(256u))));
+
+            if ( breq_.verification() ) {
+                curl_easy_setopt(curlh_.get(), CURLOPT_SSL_VERIFYPEER, 1l);
+                curl_easy_setopt(curlh_.get(), CURLOPT_SSL_VERIFYHOST, 2l);
+            } else {
+                curl_easy_setopt(curlh_.get(), CURLOPT_SSL_VERIFYPEER, 0l);
+                curl_easy_setopt(curlh_.get(), CURLOPT_SSL_VERIFYHOST, 0l);
+            }
+
+            if ( breq_.redirections() ) {
+                curl_easy_setopt(curlh_.get(), CURLOPT_FOLLOWLOCATION, 1l);
+                curl_easy_setopt(curlh_.get(), CURLOPT_MAXREDIRS,
+                    static_cast<long>(breq_.redirections()));
+            } else {
+                curl_easy_setopt(curlh_.get(), CURLOPT_FOLLOWLOCATION, 0l);
+            }
+
+            time_ms_t request_timeout = std::max(time_ms_t(1), breq_.request_timeout());
+            if ( breq_.deadline() != time_point_t::max() ) {
+                // the time spent in the queue comes out of the budget
+                const auto remaining = std::chrono::ceil<time_ms_t>(
+                    breq_.deadline() - time_point_t::clock::now());
+                request_timeout = std::clamp(remaining, time_ms_t(1), request_timeout);
+            }
+            curl_easy_setopt(curlh_.get(), CURLOPT_TIMEOUT_MS,
+                static_cast<long>(request_timeout.count()));
+
+            curl_easy_setopt(curlh_.get(), CURLOPT_CONNECTTIMEOUT_MS,
+                static_cast<long>(std::max(time_ms_t(1), breq_.connection_timeout()).count()));
+
+            last_response_ = time_point_t::clock::now();
+            response_timeout_ = std::max(time_ms_t(1), breq_.response_timeout());
+            timeout_deadline_ = response_deadline();
+
+            if ( CURLM_OK != curl_multi_add_handle(shard.curlm(), curlh_.get()) ) {
+                throw exception("curly_hpp: failed to curl_multi_add_handle");
+            }
+        }
+
+        void dequeue(shard_state& shard) noexcept {
+            if ( curlh_ ) {
+                // the reset in the pool drops all our callbacks and pointers
+                curl_multi_remove_handle(shard.curlm(), curlh_.get());
+                shard.easy_handles.release(std::move(curlh_));
+                curlh_.reset();
+            }
+        }
+
+        bool done() noexcept {
+            if ( completing_.exchange(true) ) {
+                return false;
+            }
+
+            char* last_url = nullptr;
+            if ( CURLE_OK != curl_easy_getinfo(
+                curlh_.get(),
+                CURLINFO_EFFECTIVE_URL,
+                &last_url) || !last_url )
+            {
+                publish_(req_status::failed);
+                return false;
+            }
+
+            long http_code = 0;
+            if ( CURLE_OK != curl_easy_getinfo(
+                curlh_.get(),
+                CURLINFO_RESPONSE_CODE,
+                &http_code) || !http_code )
+            {
+                publish_(req_status::failed);
+                return false;
+            }
+
+            try {
+                response_ = response(
+                    last_url,
+                    static_cast<http_code_t>(http_code),
+                    response_version_());
+                response_.content = std::move(response_content_);
+                response_.headers = std::move(response_headers_);
+                response_.stats = make_transfer_stats_();
+                response_.uploader = std::move(breq_.uploader());
+                response_.downloader = std::move(breq_.downloader());
+                response_.progressor = std::move(breq_.progressor());
+            } catch (...) {
+                publish_(req_status::failed);
+                return false;
+            }
+
+            progress_.store(1.f);
+            error_.clear();
+
+            publish_(req_status::done);
+            return true;
+        }
+
+        bool fail(CURLcode err) noexcept {
+            if ( completing_.exchange(true) ) {
+                return false;
+            }
+
+            try {
+                switch ( err ) {
+                case CURLE_OPERATION_TIMEDOUT:
+                    error_.assign("Operation timeout");
+                    publish_(req_status::timeout);
+                    break;
+                case CURLE_READ_ERROR:
+                case CURLE_WRITE_ERROR:
+                case CURLE_ABORTED_BY_CALLBACK:
+                    error_.assign("Callback aborted");
+                    publish_(req_status::cancelled);
+                    break;
+                default:
+                    error_.assign(error_buffer_[0]
+                        ? error_buffer_
+                        : "Unknown error");
+                    publish_(req_status::failed);
+                    break;
+                }
+            } catch (...) {
+                publish_(req_status::failed);
+                return true;
+            }
+
+            return true;
+        }
+
+        bool cancel() noexcept {
+            if ( completing_.exchange(true) ) {
+                return false;
+            }
+
+            try {
+                error_.assign("Operation cancelled");
+            } catch (...) {
+                publish_(req_status::failed);
+                return true;
+            }
+
+            publish_(req_status::cancelled);
+            return true;
+        }
+
+        float progress() const noexcept {
+            return progress_.load();
+        }
+
+        req_status status() const noexcept {
+            return status_.load();
+        }
+
+        bool is_done() const noexcept {
+            return status_.load() == req_status::done;
+        }
+
+        bool is_pending() const noexcept {
+            return status_.load() == req_status::pending;
+        }
+
+        req_priority priority() const noexcept {
+            return breq_.priority();
+        }
+
+        const std::string& origin() const noexcept {
+            return origin_;
+        }
+
+        time_point_t deadline() const noexcept {
+            return breq_.deadline();
+        }
+
+        req_status wait(bool wait_callback) const noexcept {
+            parking_lot::park(this, [this, wait_callback](){
+                return is_finished_(wait_callback);
+            }, [](auto& cvar, auto& lock, auto& pred){
+                cvar.wait(lock, pred);
+            });
+            return status_.load();
+        }
+
+        req_status wait_for(time_ms_t ms, bool wait_callback) const noexcept {
+            parking_lot::park(this, [this, wait_callback](){
+                return is_finished_(wait_callback);
+            }, [ms](auto& cvar, auto& lock, auto& pred){
+                cvar.wait_for(lock, ms, pred);
+            });
+            return status_.load();
+        }
+
+        req_status wait_until(time_point_t tp, bool wait_callback) const noexcept {
+            parking_lot::park(this, [this, wait_callback](){
+                return is_finished_(wait_callback);
+            }, [tp](auto& cvar, auto& lock, auto& pred){
+                cvar.wait_until(lock, tp, pred);
+            });
+            return status_.load();
+        }
+
+        response take() {
+            wait(false);
+            req_status expected = req_status::done;
+            if ( !status_.compare_exchange_strong(expected, req_status::empty) ) {
+                throw exception("curly_hpp: response is unavailable");
+            }
+            return std::move(response_);
+        }
+
+        const std::string& get_error() const noexcept {
+            wait(false);
+            return error_;
+        }
+
+        std::exception_ptr get_callback_exception() const noexcept {
+            parking_lot::park(this, [this](){
+                return callbacked_.load();
+            }, [](auto& cvar, auto& lock, auto& pred){
+                cvar.wait(lock, pred);
+            });
+            return callback_exception_;
+        }
+
+        template < typename... Args >
+        void call_callback(Args&&... args) noexcept {
+            try {
+                if ( breq_.callback() ) {
+                    breq_.callback()(std::forward<Args>(args)...);
+                }
+            } catch (...) {
+                callback_exception_ = std::current_exception();
+            }
+            assert(!callbacked_ && status_ != req_status::pending);
+            callbacked_.store(true);
+            parking_lot::unpark_all(this);
+        }
+
+        time_point_t response_deadline() const noexcept {
+            return saturating_add(last_response_.load(), response_timeout_);
+        }
+
+        void notify_cancelled() noexcept {
+            if ( const auto shard = shard_.lock() ) {
+                try {
+                    shard->cancelled_handles.enqueue(shared_from_this());
+                } catch (...) {
+                    // the transfer will be reaped when it completes
+                }
+                shard->wakeup();
+            }
+        }
+
+        // whether the request waits in the queue of its shard,
+        // it must be called under the handles lock
+        bool is_queued() const noexcept {
+            return queued_;
+        }
+
+        void queued(bool v) noexcept {
+            queued_ = v;
+        }
+
+        std::size_t active_index() const noexcept {
+            return active_index_;
+        }
+
+        void active_index(std::size_t index) noexcept {
+            active_index_ = index;
+        }
+
+        time_point_t timeout_deadline() const noexcept {
+            return timeout_deadline_;
+        }
+
+        void timeout_deadline(time_point_t deadline) noexcept {
+            timeout_deadline_ = deadline;
+        }
+
+        std::size_t timeout_index() const noexcept {
+            return timeout_index_;
+        }
+
+        void timeout_index(std::size_t index) noexcept {
+            timeout_index_ = index;
+        }
+    private:
+        http_version response_version_() const noexcept {
+            long version = CURL_HTTP_VERSION_NONE;
+            if ( CURLE_OK != curl_easy_getinfo(curlh_.get(), CURLINFO_HTTP_VERSION, &version) ) {
+                return http_version::any;
+            }
+            switch ( version ) {
+            case CURL_HTTP_VERSION_1_0:
+            case CURL_HTTP_VERSION_1_1:
+                return http_version::http1_1;
+            case CURL_HTTP_VERSION_2_0:
+                return http_version::http2;
+            default:
+                return http_version::any;
+            }
+        }
+
+        transfer_stats make_transfer_stats_() const noexcept {
+            const auto time_info = [this](CURLINFO info){
+                curl_off_t us = 0;
+                return CURLE_OK == curl_easy_getinfo(curlh_.get(), info, &us)
+                    ? time_us_t(us)
+                    : time_us_t(0);
+            };
+            transfer_stats stats;
+            stats.name_lookup = time_info(CURLINFO_NAMELOOKUP_TIME_T);
+            stats.connect = time_info(CURLINFO_CONNECT_TIME_T);
+            stats.tls_handshake = time_info(CURLINFO_APPCONNECT_TIME_T);
+            stats.start_transfer = time_info(CURLINFO_STARTTRANSFER_TIME_T);
+            stats.total = time_info(CURLINFO_TOTAL_TIME_T);
+            long new_connections = 0;
+            if ( CURLE_OK == curl_easy_getinfo(curlh_.get(), CURLINFO_NUM_CONNECTS, &new_connections) ) {
+                stats.new_connections = static_cast<std::size_t>(std::max(new_connections, 0l));
+            }
+            return stats;
+        }
+
+        void publish_(req_status status) noexcept {
+            status_.store(status);
+            parking_lot::unpark_all(this);
+        }
+
+        bool is_finished_(bool wait_callback) const noexcept {
+            return (status_.load() != req_status::pending)
+                && (!wait_callback || callbacked_.load());
+        }
+    private:
+        static std::size_t s_upload_callback_(
+            char* buffer, std::size_t size, std::size_t nitems, void* userdata) noexcept
+        {
+            auto* self = static_cast<internal_state*>(userdata);
+            return self->upload_callback_(buffer, size * nitems);
+        }
+
+        static std::size_t s_download_callback_(
+            char* ptr, std::size_t size, std::size_t nmemb, void* userdata) noexcept
+        {
+            auto* self = static_cast<internal_state*>(userdata);
+            return self->download_callback_(ptr, size * nmemb);
+        }
+
+        static int s_progress_callback_(
+            void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) noexcept
+        {
+            auto* self = static_cast<internal_state*>(clientp);
+            return self->progress_callback(dlnow, dltotal, ulnow, ultotal);
+        }
+
+        static std::size_t s_header_callback_(
+            char* buffer, std::size_t size, std::size_t nitems, void* userdata) noexcept
+        {
+            auto* self = static_cast<internal_state*>(userdata);
+            return self->header_callback_(buffer, size * nitems);
+        }
+    private:
+        std::size_t upload_callback_(char* dst, std::size_t size) noexcept {
+            try {
+                last_response_ = time_point_t::clock::now();
+
+                size = std::min(size, breq_.uploader()->size() - uploaded_);
+                const std::size_t read_bytes = breq_.uploader()->read(dst, size);
+                uploaded_ += read_bytes;
+
+                return read_bytes;
+            } catch (...) {
+                return CURL_READFUNC_ABORT;
+            }
+        }
+
+        std::size_t download_callback_(const char* src, std::size_t size) noexcept {
+            try {
+                last_response_ = time_point_t::clock::now();
+
+                const std::size_t written_bytes = breq_.downloader()->write(src, size);
+                downloaded_ += written_bytes;
+
+                return written_bytes;
+            } catch (...) {
+                return 0u;
+            }
+        }
+
+        int progress_callback(
+            curl_off_t dlnow, curl_off_t dltotal,
+            curl_off_t ulnow, curl_off_t ultotal) noexcept
+        {
+            try {
+                std::size_t dnow_sz = dlnow > 0 ? static_cast<std::size_t>(dlnow) : 0u;
+                std::size_t dtotal_sz = dltotal > 0 ? static_cast<std::size_t>(dltotal) : 0u;
+
+                std::size_t unow_sz = ulnow > 0 ? static_cast<std::size_t>(ulnow) : 0u;
+                std::size_t utotal_sz = ultotal > 0 ? static_cast<std::size_t>(ultotal) : 0u;
+
+                progress_.store(breq_.progressor()->update(dnow_sz, dtotal_sz, unow_sz, utotal_sz));
+                return 0;
+            } catch (...) {
+                return 1;
+            }
+        }
+
+        std::size_t header_callback_(const char* src, std::size_t size) noexcept {
+            try {
+                last_response_ = time_point_t::clock::now();
+
+                const std::string_view header(src, size);
+                if ( !header.compare(0u, 5u, "HTTP/") ) {
+                    response_headers_.clear();
+                } else if ( const auto sep_idx = header.find(':'); sep_idx != std::string_view::npos ) {
+                    if ( const auto key = header.substr(0, sep_idx); !key.empty() ) {
+                        auto val = header.substr(sep_idx + 1);
+                        const auto val_f = val.find_first_not_of("\t ");
+                        const auto val_l = val.find_last_not_of("\r\n\t ");
+                        val = (val_f != std::string_view::npos && val_l != std::string_view::npos)
+                            ? val.substr(val_f, val_l)
+                            : std::string_view();
+                        response_headers_.emplace(key, val);
+                    }
+                }
+
+                return header.size();
+            } catch (...) {
+                return 0;
+            }
+        }
+    private:
+        request_builder breq_;
+        std::weak_ptr<shard_state> shard_;
+        std::string origin_;
+        bool queued_{false};
+        std::size_t active_index_{no_active_index};
+        std::size_t timeout_index_{timeout_heap<internal_state>::npos};
+        time_point_t timeout_deadline_{time_point_t::max()};
+        curlh_t curlh_{nullptr, &curl_easy_cleanup};
+        slist_t hlist_{nullptr, &curl_slist_free_all};
+        std::string url_with_qparams_;
+        std::atomic<time_point_t> last_response_{time_point_t::clock::now()};
+        time_point_t::duration response_timeout_{0};
+    private:
+        response response_;
+        headers_t response_headers_;
+        std::vector<char> response_content_;
+    private:
+        std::size_t uploaded_{0u};
+        std::size_t downloaded_{0u};
+    private:
+        std::atomic<bool> callbacked_{false};
+        std::exception_ptr callback_exception_{nullptr};
+    private:
+        // the first of done/fail/cancel to set it owns the result,
+        // which is then published through status_
+        std::atomic<bool> completing_{false};
+        std::atomic<float> progress_{0.f};
+        std::atomic<req_status> status_{req_status::pending};
+        std::string error_{"Unknown error"};
+        char error_buffer_[CURL_ERROR_SIZE]{'\0'};
+    };
+}
+
+namespace curly_hpp
+{
+    request::request(internal_state_ptr state)
+    : state_(state) {
+        assert(state);
+    }
+
+    bool request::cancel() noexcept {
+        if ( !state_->cancel() ) {
+            return false;
+        }
+        state_->notify_cancelled();
+        return true;
+    }
+
+    float request::progress() const noexcept {
+        return state_->progress();
+    }
+
+    req_status request::status() const noexcept {
+        return state_->status();
+    }
+
+    bool request::is_done() const noexcept {
+        return state_->is_done();
+    }
+
+    bool request::is_pending() const noexcept {
+        return state_->is_pending();
+    }
+
+    req_status request::wait() const noexcept {
+        return state_->wait(false);
+    }
+
+    req_status request::wait_for(time_ms_t ms) const noexcept {
+        return state_->wait_for(ms, false);
+    }
+
+    req_status request::wait_until(time_point_t tp) const noexcept {
+        return state_->wait_until(tp, false);
+    }
+
+    req_status request::wait_callback() const noexcept {
+        return state_->wait(true);
+    }
+
+    req_status request::wait_callback_for(time_ms_t ms) const noexcept {
+        return state_->wait_for(ms, true);
+    }
+
+    req_status request::wait_callback_until(time_point_t tp) const noexcept {
+        return state_->wait_until(tp, true);
+    }
+
+    response request::take() {
+        return state_->take();
+    }
+
+    const std::string& request::get_error() const noexcept {
+        return state_->get_error();
+    }
+
+    std::exception_ptr request::get_callback_exception() const noexcept {
+        return state_->get_callback_exception();
+    }
+}
+
+// -----------------------------------------------------------------------------
+//
+// request_builder
+//
+// -----------------------------------------------------------------------------
+
+namespace
+{
+    using namespace curly_hpp;
+
+    // the queued slot of the request must be already taken
+    request enqueue_request(const engine::internal_state& engine, request_builder&& rb) {
+        try {
+            const auto& shard = engine.shard_for(rb.url());
+            auto sreq = std::make_shared<request::internal_state>(std::move(rb), shard);
+            shard->new_handles.enqueue(sreq);
+            shard->notify();
+            return request(sreq);
+        } catch (...) {
+            engine.admission().release_queued(1u);
+            throw;
+        }
+    }
+}
+
+namespace curly_hpp
+{
+    request_builder::request_builder(http_method m) noexcept
+    : method_(m) {}
+
+    request_builder::request_builder(std::string u) noexcept
+    : url_(std::move(u)) {}
+
+    request_builder::request_builder(http_method m, std::string u) noexcept
+    : url_(std::move(u))
+    , method_(m) {}
+
+    request_builder& request_builder::url(std::string u) noexcept {
+        url_ = std::move(u);
+        return *this;
+    }
+
+    request_builder& request_builder::method(http_method m) noexcept {
+        method_ = m;
+        return *this;
+    }
+
+    request_builder& request_builder::qparams(qparam_ilist_t ps) {
+        for ( const auto& [k,v] : ps ) {
+            qparams_.emplace(k, v);
+        }
+        return *this;
+    }
+
+    request_builder& request_builder::qparam(std::string k, std::string v) {
+        qparams_.emplace(std::move(k), std::move(v));
+        return *this;
+    }
+
+    request_builder& request_builder::headers(header_ilist_t hs) {
+        for ( const auto& [k,v] : hs ) {
+            headers_.insert_or_assign(std::string(k), v);
+        }
+        return *this;
+    }
+
+    request_builder& request_builder::header(std::string k, std::string v) {
+        headers_.insert_or_assign(std::move(k), std::move(v));
+        return *this;
+    }
+
+    request_builder& request_builder::version(http_version v) noexcept {
+        version_ = v;
+        return *this;
+    }
+
+    request_builder& request_builder::pipewait(bool v) noexcept {
+        pipewait_ = v;
+        return *this;
+    }
+
+    request_builder& request_builder::stream_weight(std::uint16_t w) noexcept {
+        stream_weight_ = w;
+        return *this;
+    }
+
+    request_builder& request_builder::priority(req_priority p) noexcept {
+        priority_ = p;
+        return *this;
+    }
+
+    request_builder& request_builder::verbose(bool v) noexcept {
+        verbose_ = v;
+        return *this;
+    }
+
+    request_builder& request_builder::verification(bool v) noexcept {
+        verification_ = v;
+        return *this;
+    }
+
+    request_builder& request_builder::redirections(std::uint32_t r) noexcept {
+        redirections_ = r;
+        return *this;
+    }
+
+    request_builder& request_builder::request_timeout(time_ms_t t) noexcept {
+        request_timeout_ = t;
+        return *this;
+    }
+
+    request_builder& request_builder::response_timeout(time_ms_t t) noexcept {
+        response_timeout_ = t;
+        return *this;
+    }
+
+    request_builder& request_builder::connection_timeout(time_ms_t t) noexcept {
+        connection_timeout_ = t;
+        return *this;
+    }
+
+    request_builder& request_builder::deadline(time_point_t tp) noexcept {
+        deadline_ = tp;
+        return *this;
+    }
+
+    request_builder& request_builder::content(std::string_view c) {
+        content_ = content_t(c);
+        return *this;
+    }
+
+    request_builder& request_builder::content(content_t c) noexcept {
+        content_ = std::move(c);
+        return *this;
+    }
+
+    request_builder& request_builder::callback(callback_t c) noexcept {
+        callback_ = std::move(c);
+        return *this;
+    }
+
+    request_builder& request_builder::uploader(uploader_uptr u) noexcept {
+        uploader_ = std::move(u);
+        return *this;
+    }
+
+    request_builder& request_builder::downloader(downloader_uptr d) noexcept {
+        downloader_ = std::move(d);
+        return *this;
+    }
+
+    request_builder& request_builder::progressor(progressor_uptr p) noexcept {
+        progressor_ = std::move(p);
+        return *this;
+    }
+
+    const std::string& request_builder::url() const noexcept {
+        return url_;
+    }
+
+    http_method request_builder::method() const noexcept {
+        return method_;
+    }
+
+    const qparams_t& request_builder::qparams() const noexcept {
+        return qparams_;
+    }
+
+    const headers_t& request_builder::headers() const noexcept {
+        return headers_;
+    }
+
+    http_version request_builder::version() const noexcept {
+        return version_;
+    }
+
+    bool request_builder::pipewait() const noexcept {
+        return pipewait_;
+    }
+
+    std::uint16_t request_builder::stream_weight() const noexcept {
+        return stream_weight_;
+    }
+
+    req_priority request_builder::priority() const noexcept {
+        return priority_;
+    }
+
+    bool request_builder::verbose() const noexcept {
+        return verbose_;
+    }
+
+    bool request_builder::verification() const noexcept {
+        return verification_;
+    }
+
+    std::uint32_t request_builder::redirections() const noexcept {
+        return redirections_;
+    }
+
+    time_ms_t request_builder::request_timeout() const noexcept {
+        return request_timeout_;
+    }
+
+    time_ms_t request_builder::response_timeout() const noexcept {
+        return response_timeout_;
+    }
+
+    time_ms_t request_builder::connection_timeout() const noexcept {
+        return connection_timeout_;
+    }
+
+    time_point_t request_builder::deadline() const noexcept {
+        return deadline_;
+    }
+
+    content_t& request_builder::content() noexcept {
+        return content_;
+    }
+
+    const content_t& request_builder::content() const noexcept {
+        return content_;
+    }
+
+    callback_t& request_builder::callback() noexcept {
+        return callback_;
+    }
+
+    const callback_t& request_builder::callback() const noexcept {
+        return callback_;
+    }
+
+    uploader_uptr& request_builder::uploader() noexcept {
+        return uploader_;
+    }
+
+    const uploader_uptr& request_builder::uploader() const noexcept {
+        return uploader_;
+    }
+
+    downloader_uptr& request_builder::downloader() noexcept {
+        return downloader_;
+    }
+
+    const downloader_uptr& request_builder::downloader() const noexcept {
+        return downloader_;
+    }
+
+    progressor_uptr& request_builder::progressor() noexcept {
+        return progressor_;
+    }
+
+    const progressor_uptr& request_builder::progressor() const noexcept {
+        return progressor_;
+    }
+
+    request request_builder::send() {
+        return send(engine::default_engine());
+    }
+
+    request request_builder::send(engine& e) {
+        e.state_->admission().acquire_queued(1u);
+        return enqueue_request(*e.state_, std::move(*this));
+    }
+
+    std::optional<request> request_builder::try_send() {
+        return try_send(engine::default_engine());
+    }
 
-                size = std::min(size, breq_.uploader()->size() - uploaded_);
-                const std::size_t read_bytes = breq_.uploader()->read(dst, size);
-                uploaded_ += read_bytes;
+    std::optional<request> request_builder::try_send(engine& e) {
+        if ( !e.state_->admission().try_acquire_queued(1u) ) {
+            return std::nullopt;
+        }
+        return enqueue_request(*e.state_, std::move(*this));
+    }
 
-                return read_bytes;
+    std::optional<request> request_builder::try_send_for(time_ms_t ms) {
+        return try_send_for(engine::default_engine(), ms);
+    }
+
+    std::optional<request> request_builder::try_send_for(engine& e, time_ms_t ms) {
+        return try_send_until(e, time_point_t::clock::now() + ms);
+    }
+
+    std::optional<request> request_builder::try_send_until(time_point_t tp) {
+        return try_send_until(engine::default_engine(), tp);
+    }
+
+    std::optional<request> request_builder::try_send_until(engine& e, time_point_t tp) {
+        if ( !e.state_->admission().acquire_queued_until(1u, tp) ) {
+            return std::nullopt;
+        }
+        return enqueue_request(*e.state_, std::move(*this));
+    }
+}
+
+// -----------------------------------------------------------------------------
+//
+// thread_pool
+//
+// -----------------------------------------------------------------------------
+
+namespace curly_hpp
+{
+    class thread_pool::internal_state final {
+    public:
+        explicit internal_state(std::size_t threads) {
+            threads_.reserve(threads);
+            try {
+                for ( std::size_t i = 0; i < threads; ++i ) {
+                    threads_.emplace_back([this](){
+                        worker_();
+                    });
+                }
             } catch (...) {
-                return CURL_READFUNC_ABORT;
+                stop();
+                throw;
             }
         }
 
-        std::size_t download_callback_(const char* src, std::size_t size) noexcept {
-            try {
+        void post(task_t task) {
+            {
                 std::lock_guard<std::mutex> guard(mutex_);
-                last_response_ = time_point_t::clock::now();
+                if ( stopped_ ) {
+                    throw exception("curly_hpp: thread pool is stopped");
+                }
+                tasks_.push_back(std::move(task));
+            }
+            cvar_.notify_one();
+        }
 
-                const std::size_t written_bytes = breq_.downloader()->write(src, size);
-                downloaded_ += written_bytes;
+        void stop() noexcept {
+            {
+                std::lock_guard<std::mutex> guard(mutex_);
+                stopped_ = true;
+            }
+            cvar_.notify_all();
+            for ( std::thread& thread : threads_ ) {
+                if ( thread.joinable() ) {
+                    thread.join();
+                }
+            }
+            threads_.clear();
+        }
+    private:
+        void worker_() noexcept {
+            while ( true ) {
+                task_t task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cvar_.wait(lock, [this](){
+                        return stopped_ || !tasks_.empty();
+                    });
+                    if ( tasks_.empty() ) {
+                        return;
+                    }
+                    task = std::move(tasks_.front());
+                    tasks_.pop_front();
+                }
+                try {
+                    task();
+                } catch (...) {
+                    // tasks have nobody to report to
+                }
+            }
+        }
+    private:
+        bool stopped_{false};
+        std::deque<task_t> tasks_;
+        std::vector<std::thread> threads_;
+    private:
+        std::mutex mutex_;
+        std::condition_variable cvar_;
+    };
+}
 
-                return written_bytes;
+namespace curly_hpp
+{
+    thread_pool::thread_pool(std::size_t threads)
+    : state_(std::make_shared<internal_state>(std::max(threads, std::size_t(1u)))) {}
+
+    thread_pool::~thread_pool() noexcept {
+        state_->stop();
+    }
+
+    void thread_pool::post(task_t task) {
+        state_->post(std::move(task));
+    }
+
+    executor_t thread_pool::executor() const {
+        return [state = state_](task_t task){
+            state->post(std::move(task));
+        };
+    }
+}
+
+// -----------------------------------------------------------------------------
+//
+// perform
+//
+// -----------------------------------------------------------------------------
+
+namespace
+{
+    using namespace curly_hpp;
+
+    void dispatch_callbacks(
+        const engine::internal_state& engine,
+        std::vector<req_state_t>& finished)
+    {
+        if ( finished.empty() ) {
+            return;
+        }
+        if ( engine.completions_enabled() ) {
+            try {
+                engine.completions().push(finished);
             } catch (...) {
-                return 0u;
+                // callbacks still report them
+            }
+        }
+        const executor_t executor = engine.executor();
+        for ( req_state_t& sreq : finished ) {
+            if ( executor ) {
+                try {
+                    executor([sreq](){
+                        sreq->call_callback(sreq);
+                    });
+                    continue;
+                } catch (...) {
+                    // the executor refused the task, so run it right here
+                }
             }
+            sreq->call_callback(sreq);
         }
+        finished.clear();
+    }
 
-        int progress_callback(
-            curl_off_t dlnow, curl_off_t dltotal,
-            curl_off_t ulnow, curl_off_t ultotal) noexcept
-        {
+    void add_active_handle(shard_state& state, req_state_t sreq) {
+        state.acquire_host(sreq->origin());
+        try {
+            state.active_handles.push_back(sreq);
             try {
-                std::lock_guard<std::mutex> guard(mutex_);
+                state.response_timeouts.push(sreq.get());
+            } catch (...) {
+                state.active_handles.pop_back();
+                throw;
+            }
+        } catch (...) {
+            state.release_host(sreq->origin());
+            throw;
+        }
+        sreq->active_index(state.active_handles.size() - 1u);
+    }
 
-                std::size_t dnow_sz = dlnow > 0 ? static_cast<std::size_t>(dlnow) : 0u;
-                std::size_t dtotal_sz = dltotal > 0 ? static_cast<std::size_t>(dltotal) : 0u;
+    req_state_t remove_active_handle(shard_state& state, request::internal_state& sreq) noexcept {
+        const std::size_t index = sreq.active_index();
+        if ( index >= state.active_handles.size() || state.active_handles[index].get() != &sreq ) {
+            return nullptr;
+        }
+        // swap with the last one, so removal doesn't depend on the number of transfers
+        req_state_t result = std::move(state.active_handles[index]);
+        if ( index + 1u != state.active_handles.size() ) {
+            state.active_handles[index] = std::move(state.active_handles.back());
+            state.active_handles[index]->active_index(index);
+        }
+        state.active_handles.pop_back();
+        state.response_timeouts.remove(result.get());
+        state.release_host(result->origin());
+        result->active_index(request::internal_state::no_active_index);
+        return result;
+    }
 
-                std::size_t unow_sz = ulnow > 0 ? static_cast<std::size_t>(ulnow) : 0u;
-                std::size_t utotal_sz = ultotal > 0 ? static_cast<std::size_t>(ultotal) : 0u;
+    // the request stays in the line of its host until the admission gets there
+    void unqueue_handle(shard_state& state, request::internal_state& sreq) noexcept {
+        state.queued_handles.remove(sreq);
+        state.queued_timeouts.remove(&sreq);
+    }
 
-                progress_ = breq_.progressor()->update(dnow_sz, dtotal_sz, unow_sz, utotal_sz);
-                return 0;
-            } catch (...) {
-                return 1;
+    // requests with a deadline also wait in a heap, so they are expired in time
+    void queue_new_handles(shard_state& state) {
+        state.new_handles.dequeue_all(state.queued_batch);
+        if ( state.queued_batch.empty() ) {
+            return;
+        }
+        state.queued_unseen = true;
+        std::size_t queued = 0u;
+        try {
+            for ( ; queued < state.queued_batch.size(); ++queued ) {
+                const req_state_t& sreq = state.queued_batch[queued];
+                if ( sreq->deadline() != time_point_t::max() ) {
+                    sreq->timeout_deadline(sreq->deadline());
+                    state.queued_timeouts.push(sreq.get());
+                }
+                try {
+                    state.queued_handles.push(sreq);
+                } catch (...) {
+                    state.queued_timeouts.remove(sreq.get());
+                    throw;
+                }
             }
+        } catch (...) {
+            // the rest of the batch is queued the next time
+            state.queued_batch.erase(
+                state.queued_batch.begin(),
+                state.queued_batch.begin() + static_cast<std::ptrdiff_t>(queued));
+            throw;
         }
+        state.queued_batch.clear();
+    }
 
-        std::size_t header_callback_(const char* src, std::size_t size) noexcept {
-            try {
-                std::lock_guard<std::mutex> guard(mutex_);
-                last_response_ = time_point_t::clock::now();
+    // returns the number of transfers that have left the shard
+    std::size_t reap_finished_handles(shard_state& state, std::vector<req_state_t>& finished) {
+        CURLM* curlm = state.curlm();
 
-                const std::string_view header(src, size);
-                if ( !header.compare(0u, 5u, "HTTP/") ) {
-                    response_headers_.clear();
-                } else if ( const auto sep_idx = header.find(':'); sep_idx != std::string_view::npos ) {
-                    if ( const auto key = header.substr(0, sep_idx); !key.empty() ) {
-                        auto val = header.substr(sep_idx + 1);
-                        const auto val_f = val.find_first_not_of("\t ");
-                        const auto val_l = val.find_last_not_of("\r\n\t ");
-                        val = (val_f != std::string_view::npos && val_l != std::string_view::npos)
-                            ? val.substr(val_f, val_l)
-                            : std::string_view();
-                        response_headers_.emplace(key, val);
-                    }
+        std::size_t reaped = 0u;
+        const auto finish = [&state, &finished, &reaped](request::internal_state& sreq){
+            if ( req_state_t removed = remove_active_handle(state, sreq) ) {
+                removed->dequeue(state);
+                finished.push_back(std::move(removed));
+                ++reaped;
+            }
+        };
+
+        while ( true ) {
+            int msgs_in_queue = 0;
+            CURLMsg* msg = curl_multi_info_read(curlm, &msgs_in_queue);
+            if ( !msg ) {
+                break;
+            }
+            if ( msg->msg != CURLMSG_DONE ) {
+                continue;
+            }
+            void* priv_ptr = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv_ptr);
+            if ( auto sreq = static_cast<req_state_t::element_type*>(priv_ptr); sreq ) {
+                if ( msg->data.result == CURLcode::CURLE_OK ) {
+                    sreq->done();
+                } else {
+                    sreq->fail(msg->data.result);
                 }
+                finish(*sreq);
+            }
+        }
 
-                return header.size();
-            } catch (...) {
-                return 0;
+        // requests cancelled in the queue are reported right away, and
+        // the new ones are queued first, so those cancelled before their
+        // shard has seen them aren't missed
+        queue_new_handles(state);
+        const std::size_t queued = state.queued_handles.size();
+        state.cancelled_handles.dequeue_all(state.cancelled_batch);
+        for ( const req_state_t& sreq : state.cancelled_batch ) {
+            if ( sreq->is_queued() ) {
+                unqueue_handle(state, *sreq);
+                finished.push_back(sreq);
+            } else {
+                finish(*sreq);
             }
         }
-    private:
-        request_builder breq_;
-        curlh_t curlh_{nullptr, &curl_easy_cleanup};
-        slist_t hlist_{nullptr, &curl_slist_free_all};
-        std::string url_with_qparams_;
-        time_point_t last_response_{time_point_t::clock::now()};
-        time_point_t::duration response_timeout_{0};
-    private:
-        response response_;
-        headers_t response_headers_;
-        std::vector<char> response_content_;
-    private:
-        std::size_t uploaded_{0u};
-        std::size_t downloaded_{0u};
-    private:
-        bool callbacked_{false};
-        std::exception_ptr callback_exception_{nullptr};
-    private:
-        float progress_{0.f};
-        req_status status_{req_status::pending};
-        std::string error_{"Unknown error"};
-        char error_buffer_[CURL_ERROR_SIZE]{'\0'};
-    private:
-        mutable std::mutex mutex_;
-        mutable std::condition_variable cvar_;
-    };
-}
+        state.cancelled_batch.clear();
+        state.admission().release_queued(queued - state.queued_handles.size());
+
+        // only transfers whose deadline has come are looked at, and
+        // a deadline moved by a later activity is just pushed further
+        const auto now = time_point_t::clock::now();
+        while ( !state.response_timeouts.empty() ) {
+            request::internal_state& sreq = *state.response_timeouts.top();
+            if ( sreq.timeout_deadline() > now ) {
+                break;
+            }
+            if ( const auto deadline = sreq.response_deadline(); deadline > now ) {
+                sreq.timeout_deadline(deadline);
+                state.response_timeouts.update(&sreq);
+                continue;
+            }
+            sreq.fail(CURLE_OPERATION_TIMEDOUT);
+            finish(sreq);
+        }
 
-namespace curly_hpp
-{
-    request::request(internal_state_ptr state)
-    : state_(state) {
-        assert(state);
+        return reaped;
     }
 
-    bool request::cancel() noexcept {
-        return state_->cancel();
+    void admit_handle(shard_state& state, req_state_t sreq, std::vector<req_state_t>& finished) {
+        unqueue_handle(state, *sreq);
+        try {
+            sreq->enqueue(state);
+            add_active_handle(state, sreq);
+        } catch (...) {
+            sreq->fail(CURLcode::CURLE_FAILED_INIT);
+            sreq->dequeue(state);
+            finished.push_back(std::move(sreq));
+            state.admission().release_active(1u);
+        }
     }
 
-    float request::progress() const noexcept {
-        return state_->progress();
+    // the hosts take turns, so a slow host that holds its slots doesn't also
+    // take the ones freed by others, returns whether the active limit has
+    // held some requests back
+    bool admit_queued_handles(shard_state& state, std::vector<req_state_t>& finished) {
+        using verdict = admission_queue<request::internal_state>::verdict;
+
+        admission_state& admission = state.admission();
+        const std::size_t max_host = admission.max_host_active();
+        const double host_rate = admission.max_host_rate();
+        const double burst = static_cast<double>(admission.max_burst());
+        const auto now = time_point_t::clock::now();
+
+        bool starved = false;
+        state.queued_handles.admit([&](const req_state_t& sreq){
+            if ( !sreq->is_pending() ) {
+                // cancelled, but the shard hasn't been told
+                unqueue_handle(state, *sreq);
+                finished.push_back(sreq);
+                return verdict::taken;
+            }
+            if ( sreq->deadline() != time_point_t::max()
+                && sreq->deadline() <= time_point_t::clock::now() )
+            {
+                // expired after the heap has been looked at, it never opens a socket
+                unqueue_handle(state, *sreq);
+                sreq->fail(CURLE_OPERATION_TIMEDOUT);
+                finished.push_back(sreq);
+                return verdict::taken;
+            }
+            if ( max_host > 0u && state.host_transfers(sreq->origin()) >= max_host ) {
+                return verdict::blocked;
+            }
+
+            rate_bucket* host_bucket = host_rate > 0.0
+                ? &state.host_bucket(sreq->origin())
+                : nullptr;
+            if ( host_bucket && !host_bucket->has_token(host_rate, burst, now) ) {
+                state.queued_deadline = std::min(
+                    state.queued_deadline,
+                    host_bucket->next_token(host_rate, now));
+                return verdict::blocked;
+            }
+
+            time_point_t next_token = time_point_t::max();
+            if ( !admission.try_take_rate_token(now, next_token) ) {
+                state.queued_deadline = std::min(state.queued_deadline, next_token);
+                return verdict::stop;
+            }
+            // transfers are counted even without limits,
+            // so the limits can be turned on at any time
+            if ( !admission.try_acquire_active() ) {
+                admission.give_back_rate_token();
+                starved = true;
+                return verdict::stop;
+            }
+            if ( host_bucket ) {
+                host_bucket->try_take(host_rate, burst, now);
+            }
+
+            admit_handle(state, sreq, finished);
+            return verdict::taken;
+        });
+        return starved;
     }
 
-    req_status request::status() const noexcept {
-        return state_->status();
+    // returns whether any request has left the queue
+    bool admit_new_handles(shard_state& state, bool freed, std::vector<req_state_t>& finished) {
+        admission_state& admission = state.admission();
+        queue_new_handles(state);
+        const std::size_t queued = state.queued_handles.size();
+
+        // only the requests whose deadline has come are looked at,
+        // the expired ones are reported without waiting for a free slot
+        const auto now = time_point_t::clock::now();
+        while ( !state.queued_timeouts.empty() ) {
+            request::internal_state& sreq = *state.queued_timeouts.top();
+            if ( sreq.timeout_deadline() > now ) {
+                break;
+            }
+            unqueue_handle(state, sreq);
+            sreq.fail(CURLE_OPERATION_TIMEDOUT);
+            finished.push_back(sreq.shared_from_this());
+        }
+
+        // the queue is only looked at when something may let its requests go,
+        // waiting ones cost nothing while the running transfers go on
+        const std::size_t limits = admission.limits_version();
+        if ( state.queued_unseen
+            || freed
+            || (state.queued_starved && admission.has_active_room())
+            || state.queued_limits != limits
+            || state.queued_deadline <= now )
+        {
+            state.queued_limits = limits;
+            state.queued_deadline = time_point_t::max();
+
+            // the drain cancels what is left in the queue
+            const bool starved = !admission.is_draining()
+                && admit_queued_handles(state, finished);
+
+            if ( const double host_rate = admission.max_host_rate(); host_rate > 0.0 ) {
+                state.trim_host_buckets(
+                    host_rate,
+                    static_cast<double>(admission.max_burst()),
+                    time_point_t::clock::now());
+            }
+
+            state.queued_unseen = false;
+            state.queued_starved = starved && !state.queued_handles.empty();
+        }
+
+        const std::size_t unqueued = queued - state.queued_handles.size();
+        admission.release_queued(unqueued);
+        return unqueued > 0u;
     }
 
-    bool request::is_done() const noexcept {
-        return state_->is_done();
+    // don't oversleep the nearest response timeout, nor the deadline of
+    // a queued request, nor the moment the rate limits let queued ones go
+    time_point_t next_shard_deadline(shard_state& state) {
+        return state.with_handles([](shard_state& handles){
+            time_point_t deadline = handles.queued_deadline;
+            if ( !handles.queued_timeouts.empty() ) {
+                deadline = std::min(deadline, handles.queued_timeouts.top()->timeout_deadline());
+            }
+            if ( !handles.response_timeouts.empty() ) {
+                deadline = std::min(deadline, handles.response_timeouts.top()->timeout_deadline());
+            }
+            return deadline;
+        });
     }
 
-    bool request::is_pending() const noexcept {
-        return state_->is_pending();
+    // runs one step of the shard, then reaps what has finished and admits
+    // what is queued, returns whether anything has happened on the shard
+    template < typename F >
+    bool service_shard(const engine::internal_state& engine, shard_state& shard, F&& step) {
+        std::vector<req_state_t> finished;
+        bool starved = false;
+
+        const bool active = shard.with([&step, &finished, &starved](shard_state& state){
+            // transfers run without the handles lock, so their handlers
+            // never stall get_all_pending_requests() and friends
+            const bool serviced = std::invoke(step, state);
+
+            // libcurl schedules an immediate timeout for every added handle,
+            // so the admitted ones are started by the very next step
+            const bool admitted = state.with_handles([&finished, &starved](shard_state& handles){
+                const std::size_t reaped = reap_finished_handles(handles, finished);
+                starved = handles.admission().release_active(reaped);
+                return admit_new_handles(handles, reaped > 0u, finished);
+            });
+
+            if ( state.is_external() ) {
+                state.sync_loop_timer(next_shard_deadline(state));
+            }
+
+            return admitted || serviced;
+        }) || !finished.empty();
+
+        // freed slots of the active limit may be taken by other shards
+        if ( starved ) {
+            engine.wakeup();
+        }
+
+        // callbacks are user code, so they never run under the shard lock
+        dispatch_callbacks(engine, finished);
+        return active;
     }
 
-    req_status request::wait() const noexcept {
-        return state_->wait(false);
+    // returns whether anything has happened on the shard
+    bool perform_shard(const engine::internal_state& engine, shard_state& shard) {
+        return service_shard(engine, shard, [](shard_state& state){
+            return state.perform();
+        });
+    }
+
+    void wait_shard_activity(shard_state& shard, time_ms_t ms) {
+        shard.with([ms](shard_state& state){
+            const time_point_t deadline = next_shard_deadline(state);
+            if ( deadline == time_point_t::max() ) {
+                state.wait(ms);
+                return;
+            }
+            const auto timeout_ms = std::chrono::ceil<time_ms_t>(
+                deadline - time_point_t::clock::now());
+            state.wait(std::clamp(timeout_ms, time_ms_t(0), ms));
+        });
+    }
+
+    drain_report cancel_engine_requests(const engine::internal_state& engine) {
+        bool starved = false;
+        drain_report report;
+        std::vector<req_state_t> finished;
+        engine.for_each_shard([&finished, &starved, &report](shard_state& state){
+            queue_new_handles(state);
+            state.queued_handles.for_each([&finished, &report](const req_state_t& sreq){
+                if ( sreq->cancel() ) {
+                    ++report.cancelled_queued;
+                }
+                finished.push_back(sreq);
+            });
+            state.admission().release_queued(state.queued_handles.size());
+            state.queued_handles.clear();
+            state.queued_timeouts.clear();
+            for ( req_state_t& sreq : state.active_handles ) {
+                if ( sreq->cancel() ) {
+                    ++report.cancelled_active;
+                }
+                sreq->dequeue(state);
+                sreq->active_index(request::internal_state::no_active_index);
+                finished.push_back(std::move(sreq));
+            }
+            starved = state.admission().release_active(state.active_handles.size()) || starved;
+            state.active_handles.clear();
+            state.response_timeouts.clear();
+            state.clear_hosts();
+            state.queued_unseen = false;
+            state.queued_starved = false;
+            state.queued_deadline = time_point_t::max();
+        });
+        if ( starved ) {
+            engine.wakeup();
+        }
+        dispatch_callbacks(engine, finished);
+        return report;
+    }
+
+    struct drain_guard final {
+        admission_state& admission;
+        ~drain_guard() noexcept {
+            admission.end_drain();
+        }
+    };
+
+    bool is_shard_idle(shard_state& shard) {
+        return shard.with_handles([](shard_state& state){
+            return state.active_handles.empty();
+        });
+    }
+
+    std::mutex default_engine_mutex;
+    bool default_engine_created{false};
+    std::size_t default_engine_shards{1u};
+}
+
+namespace curly_hpp
+{
+    void perform() {
+        engine::default_engine().perform();
+    }
+
+    void wait_activity(time_ms_t ms) {
+        engine::default_engine().wait_activity(ms);
+    }
+
+    drain_report drain(time_point_t deadline) {
+        return engine::default_engine().drain(deadline);
+    }
+
+    void cancel_all_pending_requests() {
+        engine::default_engine().cancel_all_pending_requests();
     }
 
-    req_status request::wait_for(time_ms_t ms) const noexcept {
-        return state_->wait_for(ms, false);
+    std::vector<request> get_all_pending_requests() {
+        return engine::default_engine().get_all_pending_requests();
     }
 
-    req_status request::wait_until(time_point_t tp) const noexcept {
-        return state_->wait_until(tp, false);
+    void get_all_pending_requests(std::vector<request>& dst) {
+        engine::default_engine().get_all_pending_requests(dst);
     }
 
-    req_status request::wait_callback() const noexcept {
-        return state_->wait(true);
+    std::vector<request> send_all(std::vector<request_builder> builders) {
+        return send_all(engine::default_engine(), std::move(builders));
     }
 
-    req_status request::wait_callback_for(time_ms_t ms) const noexcept {
-        return state_->wait_for(ms, true);
+    std::size_t poll_completions(std::vector<request>& dst, std::size_t max) {
+        return engine::default_engine().poll_completions(dst, max);
     }
 
-    req_status request::wait_callback_until(time_point_t tp) const noexcept {
-        return state_->wait_until(tp, true);
+    std::size_t wait_completions(std::vector<request>& dst, std::size_t max, time_ms_t ms) {
+        return engine::default_engine().wait_completions(dst, max, ms);
     }
 
-    response request::take() {
-        return state_->take();
+    std::vector<request> send_all(engine& e, std::vector<request_builder> builders) {
+        if ( builders.empty() ) {
+            // a full queue must not hold up a batch of nothing
+            return {};
+        }
+
+        const engine::internal_state& state = *e.state_;
+
+        std::vector<request> requests;
+        std::vector<std::vector<req_state_t>> batches(state.size());
+
+        state.admission().acquire_queued(builders.size());
+        try {
+            requests.reserve(builders.size());
+            for ( request_builder& builder : builders ) {
+                const std::size_t index = state.shard_index_for(builder.url());
+                auto sreq = std::make_shared<request::internal_state>(
+                    std::move(builder),
+                    state.shard_ptr(index));
+                batches[index].push_back(sreq);
+                requests.emplace_back(std::move(sreq));
+            }
+        } catch (...) {
+            state.admission().release_queued(builders.size());
+            throw;
+        }
+
+        for ( std::size_t i = 0; i < batches.size(); ++i ) {
+            if ( !batches[i].empty() ) {
+                shard_state& shard = state.shard(i);
+                shard.new_handles.enqueue_all(batches[i].begin(), batches[i].end());
+                shard.notify();
+            }
+        }
+
+        return requests;
     }
 
-    const std::string& request::get_error() const noexcept {
-        return state_->get_error();
+    void set_shard_count(std::size_t count) {
+        std::lock_guard<std::mutex> guard(default_engine_mutex);
+        if ( default_engine_created ) {
+            throw exception("curly_hpp: shard count can't be changed after first use");
+        }
+        default_engine_shards = std::max(count, std::size_t(1u));
     }
 
-    std::exception_ptr request::get_callback_exception() const noexcept {
-        return state_->get_callback_exception();
+    std::size_t shard_count() noexcept {
+        std::lock_guard<std::mutex> guard(default_engine_mutex);
+        return default_engine_shards;
     }
 }
 
 // -----------------------------------------------------------------------------
 //
-// request_builder
+// engine
 //
 // -----------------------------------------------------------------------------
 
 namespace curly_hpp
 {
-    request_builder::request_builder(http_method m) noexcept
-    : method_(m) {}
-
-    request_builder::request_builder(std::string u) noexcept
-    : url_(std::move(u)) {}
+    engine::engine()
+    : engine(1u) {}
 
-    request_builder::request_builder(http_method m, std::string u) noexcept
-    : url_(std::move(u))
-    , method_(m) {}
+    engine::engine(std::size_t shards)
+    : state_(std::make_shared<internal_state>(std::max(shards, std::size_t(1u)))) {}
 
-    request_builder& request_builder::url(std::string u) noexcept {
-        url_ = std::move(u);
-        return *this;
+    engine::~engine() noexcept {
+        try {
+            cancel_all_pending_requests();
+        } catch (...) {
+            // nothing left to report to
+        }
     }
 
-    request_builder& request_builder::method(http_method m) noexcept {
-        method_ = m;
-        return *this;
+    engine& engine::default_engine() {
+        static engine self([](){
+            std::lock_guard<std::mutex> guard(default_engine_mutex);
+            default_engine_created = true;
+            return default_engine_shards;
+        }());
+        return self;
     }
 
-    request_builder& request_builder::qparams(qparam_ilist_t ps) {
-        for ( const auto& [k,v] : ps ) {
-            qparams_.emplace(k, v);
-        }
-        return *this;
+    std::size_t engine::shard_count() const noexcept {
+        return state_->size();
     }
 
-    request_builder& request_builder::qparam(std::string k, std::string v) {
-        qparams_.emplace(std::move(k), std::move(v));
-        return *this;
+    executor_t engine::executor() const {
+        return state_->executor();
     }
 
-    request_builder& request_builder::headers(header_ilist_t hs) {
-        for ( const auto& [k,v] : hs ) {
-            headers_.insert_or_assign(std::string(k), v);
-        }
-        return *this;
+    void engine::executor(executor_t e) {
+        state_->executor(std::move(e));
     }
 
-    request_builder& request_builder::header(std::string k, std::string v) {
-        headers_.insert_or_assign(std::move(k), std::move(v));
-        return *this;
+    std::size_t engine::max_host_connections() const noexcept {
+        return state_->connections().max_host_connections;
     }
 
-    request_builder& request_builder::verbose(bool v) noexcept {
-        verbose_ = v;
-        return *this;
+    void engine::max_host_connections(std::size_t count) {
+        state_->update_connections([count](connection_options& options){
+            options.max_host_connections = count;
+        });
     }
 
-    request_builder& request_builder::verification(bool v) noexcept {
-        verification_ = v;
-        return *this;
+    std::size_t engine::max_total_connections() const noexcept {
+        return state_->connections().max_total_connections;
     }
 
-    request_builder& request_builder::redirections(std::uint32_t r) noexcept {
-        redirections_ = r;
-        return *this;
+    void engine::max_total_connections(std::size_t count) {
+        state_->update_connections([count](connection_options& options){
+            options.max_total_connections = count;
+        });
     }
 
-    request_builder& request_builder::request_timeout(time_ms_t t) noexcept {
-        request_timeout_ = t;
-        return *this;
+    std::size_t engine::max_idle_connections() const noexcept {
+        return state_->connections().max_idle_connections;
     }
 
-    request_builder& request_builder::response_timeout(time_ms_t t) noexcept {
-        response_timeout_ = t;
-        return *this;
+    void engine::max_idle_connections(std::size_t count) {
+        state_->update_connections([count](connection_options& options){
+            options.max_idle_connections = count;
+        });
     }
 
-    request_builder& request_builder::connection_timeout(time_ms_t t) noexcept {
-        connection_timeout_ = t;
-        return *this;
+    time_sec_t engine::max_idle_time() const noexcept {
+        return state_->connections().max_idle_time;
     }
 
-    request_builder& request_builder::content(std::string_view c) {
-        content_ = content_t(c);
-        return *this;
+    void engine::max_idle_time(time_sec_t t) {
+        state_->update_connections([t](connection_options& options){
+            options.max_idle_time = std::max(t, time_sec_t(0));
+        });
     }
 
-    request_builder& request_builder::content(content_t c) noexcept {
-        content_ = std::move(c);
-        return *this;
+    time_sec_t engine::max_connection_lifetime() const noexcept {
+        return state_->connections().max_connection_lifetime;
     }
 
-    request_builder& request_builder::callback(callback_t c) noexcept {
-        callback_ = std::move(c);
-        return *this;
+    void engine::max_connection_lifetime(time_sec_t t) {
+        state_->update_connections([t](connection_options& options){
+            options.max_connection_lifetime = std::max(t, time_sec_t(0));
+        });
     }
 
-    request_builder& request_builder::uploader(uploader_uptr u) noexcept {
-        uploader_ = std::move(u);
-        return *this;
+    bool engine::multiplexing() const noexcept {
+        return state_->connections().multiplexing;
     }
 
-    request_builder& request_builder::downloader(downloader_uptr d) noexcept {
-        downloader_ = std::move(d);
-        return *this;
+    void engine::multiplexing(bool enable) {
+        state_->update_connections([enable](connection_options& options){
+            options.multiplexing = enable;
+        });
     }
 
-    request_builder& request_builder::progressor(progressor_uptr p) noexcept {
-        progressor_ = std::move(p);
-        return *this;
+    std::size_t engine::max_active_requests() const noexcept {
+        return state_->admission().max_active();
     }
 
-    const std::string& request_builder::url() const noexcept {
-        return url_;
+    void engine::max_active_requests(std::size_t count) noexcept {
+        state_->admission().max_active(count);
+        // a raised limit lets shards admit what they have held back
+        state_->wakeup();
     }
 
-    http_method request_builder::method() const noexcept {
-        return method_;
+    std::size_t engine::max_host_requests() const noexcept {
+        return state_->admission().max_host_active();
     }
 
-    const qparams_t& request_builder::qparams() const noexcept {
-        return qparams_;
+    void engine::max_host_requests(std::size_t count) noexcept {
+        state_->admission().max_host_active(count);
+        state_->wakeup();
     }
 
-    const headers_t& request_builder::headers() const noexcept {
-        return headers_;
+    double engine::max_request_rate() const noexcept {
+        return state_->admission().max_rate();
     }
 
-    bool request_builder::verbose() const noexcept {
-        return verbose_;
+    void engine::max_request_rate(double per_second) {
+        if ( !(per_second >= 0.0) ) {
+            throw exception("curly_hpp: request rate must not be negative");
+        }
+        state_->admission().max_rate(per_second);
+        state_->wakeup();
     }
 
-    bool request_builder::verification() const noexcept {
-        return verification_;
+    double engine::max_host_request_rate() const noexcept {
+        return state_->admission().max_host_rate();
     }
 
-    std::uint32_t request_builder::redirections() const noexcept {
-        return redirections_;
+    void engine::max_host_request_rate(double per_second) {
+        if ( !(per_second >= 0.0) ) {
+            throw exception("curly_hpp: request rate must not be negative");
+        }
+        state_->admission().max_host_rate(per_second);
+        state_->wakeup();
     }
 
-    time_ms_t request_builder::request_timeout() const noexcept {
-        return request_timeout_;
+    std::size_t engine::max_request_burst() const noexcept {
+        return state_->admission().max_burst();
     }
 
-    time_ms_t request_builder::response_timeout() const noexcept {
-        return response_timeout_;
+    void engine::max_request_burst(std::size_t count) noexcept {
+        state_->admission().max_burst(count);
     }
 
-    time_ms_t request_builder::connection_timeout() const noexcept {
-        return connection_timeout_;
+    std::size_t engine::max_queued_requests() const noexcept {
+        return state_->admission().max_queued();
     }
 
-    content_t& request_builder::content() noexcept {
-        return content_;
+    void engine::max_queued_requests(std::size_t count) noexcept {
+        state_->admission().max_queued(count);
     }
 
-    const content_t& request_builder::content() const noexcept {
-        return content_;
+    std::size_t engine::handle_pool_size() const noexcept {
+        return state_->shard(0u).easy_handles.max_size();
     }
 
-    callback_t& request_builder::callback() noexcept {
-        return callback_;
+    void engine::handle_pool_size(std::size_t size) {
+        for ( std::size_t i = 0; i < state_->size(); ++i ) {
+            state_->shard(i).easy_handles.max_size(size);
+            state_->shard(i).with([](shard_state& shard){
+                shard.easy_handles.shrink();
+            });
+        }
     }
 
-    const callback_t& request_builder::callback() const noexcept {
-        return callback_;
+    bool engine::completion_queue() const noexcept {
+        return state_->completions_enabled();
     }
 
-    uploader_uptr& request_builder::uploader() noexcept {
-        return uploader_;
+    void engine::completion_queue(bool enable) noexcept {
+        state_->completions_enabled(enable);
     }
 
-    const uploader_uptr& request_builder::uploader() const noexcept {
-        return uploader_;
+    std::size_t engine::poll_completions(std::vector<request>& dst, std::size_t max) {
+        return state_->completions().poll(dst, max);
     }
 
-    downloader_uptr& request_builder::downloader() noexcept {
-        return downloader_;
+    std::size_t engine::wait_completions(std::vector<request>& dst, std::size_t max, time_ms_t ms) {
+        return state_->completions().wait(dst, max, ms);
     }
 
-    const downloader_uptr& request_builder::downloader() const noexcept {
-        return downloader_;
+    void engine::perform() {
+        for ( std::size_t i = 0; i < state_->size(); ++i ) {
+            perform_shard(*state_, state_->shard(i));
+        }
     }
 
-    progressor_uptr& request_builder::progressor() noexcept {
-        return progressor_;
+    void engine::wait_activity(time_ms_t ms) {
+        if ( state_->size() == 1u ) {
+            wait_shard_activity(state_->shard(0u), ms);
+            return;
+        }
+        // shards can't be waited on together, so each one gets a slice
+        const time_ms_t slice = std::max(
+            time_ms_t(1),
+            ms / static_cast<time_ms_t::rep>(state_->size()));
+        for ( std::size_t i = 0; i < state_->size(); ++i ) {
+            if ( state_->shard(i).has_new_handles() ) {
+                return;
+            }
+        }
+        for ( std::size_t i = 0; i < state_->size(); ++i ) {
+            wait_shard_activity(state_->shard(i), slice);
+        }
     }
 
-    const progressor_uptr& request_builder::progressor() const noexcept {
-        return progressor_;
+    void engine::attach_loop(loop_hooks hooks) {
+        state_->attach_loop(std::move(hooks));
+        // admits what has been queued so far and arms the timer
+        on_wakeup();
     }
 
-    request request_builder::send() {
-        auto sreq = std::make_shared<request::internal_state>(std::move(*this));
-        new_handles.enqueue(sreq);
-        return request(sreq);
+    void engine::on_socket_ready(socket_t s, socket_events events) {
+        int ev_bitmask = 0;
+        if ( events.read ) {
+            ev_bitmask |= CURL_CSELECT_IN;
+        }
+        if ( events.write ) {
+            ev_bitmask |= CURL_CSELECT_OUT;
+        }
+        if ( events.error ) {
+            ev_bitmask |= CURL_CSELECT_ERR;
+        }
+        service_shard(*state_, state_->loop_shard(), [s, ev_bitmask](shard_state& state){
+            state.socket_action(static_cast<curl_socket_t>(s), ev_bitmask);
+            return true;
+        });
     }
-}
 
-// -----------------------------------------------------------------------------
-//
-// performer
-//
-// -----------------------------------------------------------------------------
+    void engine::on_timeout() {
+        service_shard(*state_, state_->loop_shard(), [](shard_state& state){
+            state.forget_loop_timer();
+            return state.expire_timer();
+        });
+    }
 
-namespace curly_hpp
-{
-    performer::performer() {
-        thread_ = std::thread([this](){
-            while ( !done_ ) {
-                curly_hpp::perform();
-                curly_hpp::wait_activity(wait_activity());
-            }
+    void engine::on_wakeup() {
+        service_shard(*state_, state_->loop_shard(), [](shard_state& state){
+            state.clear_loop_wakeup();
+            return false;
         });
     }
 
-    performer::~performer() noexcept {
-        done_.store(true);
-        if ( thread_.joinable() ) {
-            thread_.join();
+    drain_report engine::drain(time_point_t deadline) {
+        admission_state& admission = state_->admission();
+        admission.begin_drain();
+        const drain_guard guard{admission};
+
+        // nothing is admitted from now on, so the in-flight set only shrinks
+        std::vector<request> in_flight;
+        state_->for_each_shard_handles([&in_flight](shard_state& state){
+            in_flight.insert(in_flight.end(), state.active_handles.begin(), state.active_handles.end());
+        });
+
+        for ( const request& req : in_flight ) {
+            req.wait_callback_until(deadline);
         }
+
+        // those that complete right before the cancel count as finished,
+        // only the in-flight ones can still be active by now
+        drain_report report = cancel_engine_requests(*state_);
+        report.finished = in_flight.size() - report.cancelled_active;
+        return report;
     }
 
-    time_ms_t performer::wait_activity() const noexcept {
-        return wait_activity_;
+    void engine::cancel_all_pending_requests() {
+        cancel_engine_requests(*state_);
     }
 
-    void performer::wait_activity(time_ms_t ms) noexcept {
-        wait_activity_ = ms;
+    std::vector<request> engine::get_all_pending_requests() const {
+        std::vector<request> requests;
+        get_all_pending_requests(requests);
+        return requests;
+    }
+
+    void engine::get_all_pending_requests(std::vector<request>& dst) const {
+        state_->for_each_shard_handles([&dst](shard_state& state){
+            queue_new_handles(state);
+            state.queued_handles.for_each([&dst](const req_state_t& sreq){
+                dst.emplace_back(sreq);
+            });
+            dst.insert(dst.end(), state.active_handles.begin(), state.active_handles.end());
+        });
     }
 }
 
 // -----------------------------------------------------------------------------
 //
-// perform
+// performer
 //
 // -----------------------------------------------------------------------------
 
-namespace curly_hpp
+namespace
 {
-    void perform() {
-        curl_state::with([](CURLM* curlm){
-            req_state_t sreq;
-            while ( new_handles.try_dequeue(sreq) ) {
-                if ( !sreq->is_pending() ) {
-                    sreq->call_callback(sreq);
-                    continue;
-                }
-                try {
-                    sreq->enqueue(curlm);
-                    active_handles.emplace_back(sreq);
-                } catch (...) {
-                    sreq->fail(CURLcode::CURLE_FAILED_INIT);
-                    sreq->dequeue(curlm);
-                    sreq->call_callback(sreq);
-                }
-            }
-        });
+    using namespace curly_hpp;
 
-        curl_state::with([](CURLM* curlm){
-            int running_handles = 0;
-            if ( CURLM_OK != curl_multi_perform(curlm, &running_handles) ) {
-                throw exception("curly_hpp: failed to curl_multi_perform");
+    void place_thread(
+        std::thread& thread,
+        const thread_options& options,
+        std::size_t index,
+        std::size_t count)
+    {
+    #if defined(__linux__)
+        const pthread_t handle = thread.native_handle();
+
+        if ( !options.name.empty() ) {
+            constexpr std::size_t max_name_length{15u};
+            const std::string suffix = count > 1u
+                ? "-" + std::to_string(index)
+                : std::string();
+            const std::string name = options.name.substr(
+                0u, max_name_length - std::min(suffix.size(), max_name_length)) + suffix;
+            if ( 0 != pthread_setname_np(handle, name.c_str()) ) {
+                throw exception("curly_hpp: failed to pthread_setname_np");
             }
+        }
 
-            while ( true ) {
-                int msgs_in_queue = 0;
-                CURLMsg* msg = curl_multi_info_read(curlm, &msgs_in_queue);
-                if ( !msg ) {
-                    break;
-                }
-                if ( msg->msg != CURLMSG_DONE ) {
-                    continue;
-                }
-                void* priv_ptr = nullptr;
-                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv_ptr);
-                if ( auto sreq = static_cast<req_state_t::element_type*>(priv_ptr); sreq ) {
-                    if ( msg->data.result == CURLcode::CURLE_OK ) {
-                        sreq->done();
-                    } else {
-                        sreq->fail(msg->data.result);
-                    }
+        if ( !options.cpus.empty() ) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            for ( const std::size_t cpu : options.cpus ) {
+                if ( cpu >= CPU_SETSIZE ) {
+                    throw exception("curly_hpp: performer cpu is out of range");
                 }
+                CPU_SET(cpu, &cpus);
             }
-
-            const auto now = time_point_t::clock::now();
-            for ( const auto& sreq : active_handles ) {
-                if ( sreq->check_response_timeout(now) ) {
-                    sreq->fail(CURLE_OPERATION_TIMEDOUT);
-                }
+            if ( 0 != pthread_setaffinity_np(handle, sizeof(cpus), &cpus) ) {
+                throw exception("curly_hpp: failed to pthread_setaffinity_np");
             }
-        });
+        }
 
-        curl_state::with([](CURLM* curlm){
-            for ( auto iter = active_handles.begin(); iter != active_handles.end(); ) {
-                if ( !(*iter)->is_pending() ) {
-                    (*iter)->dequeue(curlm);
-                    (*iter)->call_callback(*iter);
-                    iter = active_handles.erase(iter);
-                } else {
-                    ++iter;
-                }
+        if ( options.sched_policy >= 0 ) {
+            sched_param param{};
+            param.sched_priority = options.sched_priority;
+            if ( 0 != pthread_setschedparam(handle, options.sched_policy, &param) ) {
+                throw exception("curly_hpp: failed to pthread_setschedparam");
             }
-        });
+        }
+    #else
+        (void)thread;
+        (void)index;
+        (void)count;
+        if ( !options.name.empty() || !options.cpus.empty() || options.sched_policy >= 0 ) {
+            throw exception("curly_hpp: performer thread options aren't supported on this platform");
+        }
+    #endif
     }
+}
 
-    void wait_activity(time_ms_t ms) {
-        curl_state::with([ms](CURLM* curlm){
-            if ( active_handles.empty() ) {
-                new_handles.wait_for(ms);
-            } else if ( new_handles.empty() ) {
-                const int timeout_ms = static_cast<int>(ms.count());
-                if ( CURLM_OK != curl_multi_wait(curlm, nullptr, 0, timeout_ms, nullptr) ) {
-                    throw exception("curly_hpp: failed to curl_multi_wait");
-                }
+namespace curly_hpp
+{
+    performer::performer()
+    : performer(engine::default_engine()) {}
+
+    performer::performer(engine& e)
+    : performer(e, thread_options()) {}
+
+    performer::performer(engine& e, thread_options options)
+    : engine_(e.state_)
+    {
+        engine_->attach_performer();
+        threads_.reserve(engine_->size());
+        try {
+            for ( std::size_t i = 0; i < engine_->size(); ++i ) {
+                threads_.emplace_back([this, &shard = engine_->shard(i)](){
+                    time_point_t spin_deadline = time_point_t::min();
+                    time_ms_t backoff = backoff_time();
+                    while ( !done_ ) {
+                        const auto now = time_point_t::clock::now();
+                        if ( perform_shard(*engine_, shard) ) {
+                            spin_deadline = saturating_add(now, spin_time());
+                            backoff = backoff_time();
+                        }
+                        if ( time_point_t::clock::now() < spin_deadline ) {
+                            // busy polling right after activity saves the wakeup latency
+                            std::this_thread::yield();
+                            continue;
+                        }
+                        if ( is_shard_idle(shard) ) {
+                            // an idle performer sleeps until send() or shutdown wakes it up
+                            wait_shard_activity(shard, time_ms_t::max());
+                            continue;
+                        }
+                        // blocking waits grow from backoff_time up to wait_activity
+                        const time_ms_t max_wait = wait_activity();
+                        wait_shard_activity(shard, std::min(backoff, max_wait));
+                        backoff = backoff < max_wait / 2
+                            ? std::max(backoff * 2, time_ms_t(1))
+                            : max_wait;
+                    }
+                });
+                place_thread(threads_.back(), options, i, engine_->size());
             }
-        });
+        } catch (...) {
+            stop_();
+            throw;
+        }
     }
 
-    void cancel_all_pending_requests() {
-        req_state_t sreq;
-        while ( new_handles.try_dequeue(sreq) ) {
-            sreq->cancel();
-            sreq->call_callback(sreq);
-        }
-        curl_state::with([](CURLM* curlm){
-            for ( auto iter = active_handles.begin(); iter != active_handles.end(); ) {
-                (*iter)->cancel();
-                (*iter)->dequeue(curlm);
-                (*iter)->call_callback(*iter);
-                iter = active_handles.erase(iter);
-            }
-        });
+    performer::~performer() noexcept {
+        stop_();
     }
 
-    std::vector<request> get_all_pending_requests() {
-        std::vector<request> requests;
-        get_all_pending_requests(requests);
-        return requests;
+    time_ms_t performer::wait_activity() const noexcept {
+        return wait_activity_;
     }
 
-    void get_all_pending_requests(std::vector<request>& dst) {
-        new_handles.copy_to(dst);
-        curl_state::with([&dst](CURLM*){
-            dst.insert(dst.end(), active_handles.begin(), active_handles.end());
-        });
+    void performer::wait_activity(time_ms_t ms) noexcept {
+        wait_activity_ = ms;
+    }
+
+    time_us_t performer::spin_time() const noexcept {
+        return spin_time_;
+    }
+
+    void performer::spin_time(time_us_t us) noexcept {
+        spin_time_ = std::max(us, time_us_t(0));
+    }
+
+    time_ms_t performer::backoff_time() const noexcept {
+        return backoff_time_;
+    }
+
+    void performer::backoff_time(time_ms_t ms) noexcept {
+        backoff_time_ = std::max(ms, time_ms_t(0));
+    }
+
+    void performer::stop_() noexcept {
+        done_.store(true);
+        engine_->wakeup();
+        for ( std::thread& thread : threads_ ) {
+            if ( thread.joinable() ) {
+                thread.join();
+            }
+        }
+        threads_.clear();
+        engine_->detach_performer();
     }
 }
@@ -15,13 +15,20 @@ namespace netex = promise_hpp;
 #include <rapidjson/document.h>
 namespace json = rapidjson;
 
+#include <curl/curl.h>
+
 #include "png_data.h"
 #include "jpeg_data.h"
 
+#include <cstdlib>
 #include <fstream>
 #include <utility>
 #include <iostream>
 
+#if defined(__linux__)
+#  include <poll.h>
+#endif
+
 namespace
 {
     json::Document json_parse(std::string_view data) {
@@ -567,6 +574,15 @@ TEST_CASE("curly") {
             REQUIRE(req.wait_for(net::time_sec_t(1)) == net::req_status::pending);
             REQUIRE(req.wait_for(net::time_sec_t(5)) == net::req_status::timeout);
         }
+        {
+            auto req = net::request_builder()
+                .url("http://httpbin.org/drip?duration=4&numbytes=4&code=200&delay=1")
+                .method(net::http_method::GET)
+                .response_timeout(net::time_sec_t(3))
+                .send();
+            REQUIRE(req.wait() == net::req_status::done);
+            REQUIRE(req.take().content.size() == 4u);
+        }
         {
             auto resp = net::request_builder()
                 .url("http://httpbin.org/base64/SFRUUEJJTiBpcyBhd2Vzb21l")
@@ -1017,6 +1033,671 @@ TEST_CASE("curly/get_all_pending_requests") {
     }
 }
 
+TEST_CASE("curly/engine") {
+    SUBCASE("independent engines") {
+        net::engine engine1;
+        net::engine engine2(2u);
+        REQUIRE(engine1.shard_count() == 1u);
+        REQUIRE(engine2.shard_count() == 2u);
+
+        net::performer performer1(engine1);
+        net::performer performer2(engine2);
+        REQUIRE_THROWS_AS(net::performer(engine1), net::exception);
+
+        auto req1 = net::request_builder("https://httpbin.org/status/200").send(engine1);
+        auto req2 = net::request_builder("https://httpbin.org/status/201").send(engine2);
+        REQUIRE(req1.take().http_code() == 200u);
+        REQUIRE(req2.take().http_code() == 201u);
+    }
+
+    SUBCASE("pending requests") {
+        net::engine engine;
+
+        auto req = net::request_builder("https://httpbin.org/delay/2").send(engine);
+        REQUIRE(engine.get_all_pending_requests().size() == 1u);
+        REQUIRE(net::get_all_pending_requests().empty());
+
+        engine.cancel_all_pending_requests();
+        REQUIRE(req.status() == net::req_status::cancelled);
+        REQUIRE(engine.get_all_pending_requests().empty());
+    }
+
+    SUBCASE("connection limits") {
+        net::engine engine;
+        REQUIRE(engine.max_host_connections() == 0u);
+        REQUIRE(engine.max_idle_connections() > 0u);
+
+        engine.max_host_connections(1u);
+        engine.max_total_connections(4u);
+        engine.max_idle_time(net::time_sec_t(30));
+        engine.max_connection_lifetime(net::time_sec_t(300));
+        REQUIRE(engine.max_host_connections() == 1u);
+        REQUIRE(engine.max_total_connections() == 4u);
+        REQUIRE(engine.max_idle_time() == net::time_sec_t(30));
+        REQUIRE(engine.max_connection_lifetime() == net::time_sec_t(300));
+
+        net::performer performer(engine);
+
+        std::vector<net::request_builder> builders;
+        for ( std::size_t i = 0; i < 3u; ++i ) {
+            builders.emplace_back("https://httpbin.org/status/200");
+        }
+        for ( net::request& req : net::send_all(engine, std::move(builders)) ) {
+            const auto resp = req.take();
+            REQUIRE(resp.http_code() == 200u);
+            REQUIRE(resp.stats.new_connections <= 1u);
+        }
+    }
+
+    SUBCASE("request limits") {
+        net::engine engine;
+        REQUIRE(engine.max_active_requests() == 0u);
+        REQUIRE(engine.max_queued_requests() == 0u);
+
+        engine.max_queued_requests(2u);
+        REQUIRE(engine.max_queued_requests() == 2u);
+        {
+            auto req1 = net::request_builder("https://httpbin.org/status/200").try_send(engine);
+            auto req2 = net::request_builder("https://httpbin.org/status/201").try_send(engine);
+            REQUIRE(req1);
+            REQUIRE(req2);
+
+            net::request_builder builder("https://httpbin.org/status/202");
+            REQUIRE_FALSE(builder.try_send(engine));
+            REQUIRE_FALSE(builder.try_send_for(engine, net::time_ms_t(10)));
+            REQUIRE(builder.url() == "https://httpbin.org/status/202");
+            REQUIRE(net::send_all(engine, {}).empty());
+
+            REQUIRE(req1->cancel());
+            engine.perform();
+            auto req3 = builder.try_send(engine);
+            REQUIRE(req3);
+
+            net::performer performer(engine);
+            REQUIRE(req2->take().http_code() == 201u);
+            REQUIRE(req3->take().http_code() == 202u);
+        }
+
+        engine.max_active_requests(1u);
+        engine.max_queued_requests(1u);
+        REQUIRE(engine.max_active_requests() == 1u);
+        {
+            net::performer performer(engine);
+
+            std::vector<net::request> requests;
+            for ( std::size_t i = 0; i < 3u; ++i ) {
+                requests.push_back(net::request_builder("https://httpbin.org/delay/1").send(engine));
+            }
+
+            const auto begin = std::chrono::steady_clock::now();
+            for ( net::request& req : requests ) {
+                REQUIRE(req.take().http_code() == 200u);
+            }
+            REQUIRE(std::chrono::steady_clock::now() - begin > net::time_sec_t(1));
+        }
+    }
+
+    SUBCASE("cancel before admission") {
+        net::engine engine;
+        engine.max_active_requests(1u);
+        engine.max_queued_requests(2u);
+
+        auto slow = net::request_builder("https://httpbin.org/delay/1").send(engine);
+        engine.perform();
+        auto queued = net::request_builder("https://httpbin.org/status/200").send(engine);
+        engine.perform();
+
+        // cancelled before its shard has even seen it
+        bool called = false;
+        auto req = net::request_builder("https://httpbin.org/status/201")
+            .callback([&called](net::request){ called = true; })
+            .send(engine);
+        REQUIRE(req.cancel());
+        engine.perform();
+        REQUIRE(req.wait_callback_for(net::time_sec_t(1)) == net::req_status::cancelled);
+        REQUIRE(called);
+        REQUIRE(engine.get_all_pending_requests().size() == 2u);
+
+        auto next = net::request_builder("https://httpbin.org/status/202").try_send(engine);
+        REQUIRE(next);
+
+        net::performer performer(engine);
+        REQUIRE(slow.take().http_code() == 200u);
+        REQUIRE(queued.take().http_code() == 200u);
+        REQUIRE(next->take().http_code() == 202u);
+    }
+
+    SUBCASE("limits after unlimited traffic") {
+        net::engine engine;
+        net::performer performer(engine);
+        {
+            auto req1 = net::request_builder("https://httpbin.org/status/200").send(engine);
+            auto req2 = net::request_builder("https://httpbin.org/status/201").send(engine);
+            REQUIRE(req1.take().http_code() == 200u);
+            REQUIRE(req2.take().http_code() == 201u);
+        }
+
+        engine.max_active_requests(1u);
+        auto req = net::request_builder("https://httpbin.org/status/202").send(engine);
+        REQUIRE(req.wait_for(net::time_sec_t(5)) == net::req_status::done);
+        REQUIRE(req.take().http_code() == 202u);
+    }
+
+    SUBCASE("request priorities") {
+        REQUIRE(net::request_builder().priority() == net::req_priority::normal);
+
+        net::engine engine;
+        engine.max_active_requests(1u);
+        net::performer performer(engine);
+
+        std::vector<net::request_builder> builders;
+        for ( std::size_t i = 0; i < 4u; ++i ) {
+            builders.emplace_back("https://httpbin.org/delay/1")
+                .priority(net::req_priority::low);
+        }
+        auto bulk = net::send_all(engine, std::move(builders));
+
+        // the interactive request overtakes the bulk ones still in the queue
+        auto req = net::request_builder("https://httpbin.org/status/200")
+            .priority(net::req_priority::high)
+            .send(engine);
+        REQUIRE(req.take().http_code() == 200u);
+        REQUIRE(bulk.back().is_pending());
+
+        for ( net::request& bulk_req : bulk ) {
+            REQUIRE(bulk_req.take().http_code() == 200u);
+        }
+    }
+
+    SUBCASE("host limits") {
+        net::engine engine;
+        REQUIRE(engine.max_host_requests() == 0u);
+
+        engine.max_active_requests(2u);
+        engine.max_host_requests(1u);
+        REQUIRE(engine.max_host_requests() == 1u);
+        net::performer performer(engine);
+
+        std::vector<net::request_builder> builders;
+        for ( std::size_t i = 0; i < 3u; ++i ) {
+            builders.emplace_back("https://httpbin.org/delay/1");
+        }
+        builders.emplace_back("https://www.httpbin.org/status/200");
+        auto requests = net::send_all(engine, std::move(builders));
+
+        // the slow host runs one transfer at a time, the other one isn't kept waiting
+        REQUIRE(requests.back().take().http_code() == 200u);
+        REQUIRE(requests[1].is_pending());
+        REQUIRE(requests[2].is_pending());
+
+        for ( net::request& req : requests ) {
+            req.wait();
+        }
+    }
+
+    SUBCASE("rate limits") {
+        net::engine engine;
+        REQUIRE(engine.max_request_rate() == 0.0);
+        REQUIRE(engine.max_host_request_rate() == 0.0);
+        REQUIRE(engine.max_request_burst() == 1u);
+        REQUIRE_THROWS_AS(engine.max_request_rate(-1.0), net::exception);
+
+        engine.max_request_rate(8.0);
+        engine.max_host_request_rate(4.0);
+        engine.max_request_burst(2u);
+        REQUIRE(engine.max_request_rate() == 8.0);
+        REQUIRE(engine.max_host_request_rate() == 4.0);
+        REQUIRE(engine.max_request_burst() == 2u);
+        net::performer performer(engine);
+
+        std::vector<net::request_builder> builders;
+        for ( std::size_t i = 0; i < 6u; ++i ) {
+            builders.emplace_back("https://httpbin.org/status/200");
+        }
+
+        // a burst of two goes at once, the others follow at four per second
+        const auto begin = std::chrono::steady_clock::now();
+        for ( net::request& req : net::send_all(engine, std::move(builders)) ) {
+            REQUIRE(req.take().http_code() == 200u);
+        }
+        REQUIRE(std::chrono::steady_clock::now() - begin >= net::time_ms_t(1000));
+    }
+
+    SUBCASE("queue deadlines") {
+        REQUIRE(net::request_builder().deadline() == net::time_point_t::max());
+
+        net::engine engine;
+        engine.max_active_requests(1u);
+        net::performer performer(engine);
+
+        const auto now = net::time_point_t::clock::now();
+        auto req1 = net::request_builder("https://httpbin.org/delay/2").send(engine);
+        auto req2 = net::request_builder("https://httpbin.org/status/200")
+            .deadline(now + net::time_ms_t(500))
+            .send(engine);
+        auto req3 = net::request_builder("https://httpbin.org/status/200")
+            .deadline(now - net::time_ms_t(1))
+            .send(engine);
+
+        // expired in the queue while the only slot is busy
+        REQUIRE(req3.wait() == net::req_status::timeout);
+        REQUIRE(req2.wait() == net::req_status::timeout);
+        REQUIRE(req1.is_pending());
+        REQUIRE(req1.take().http_code() == 200u);
+
+        // the rest of the budget limits the transfer itself
+        engine.max_active_requests(0u);
+        auto req4 = net::request_builder("https://httpbin.org/delay/3")
+            .deadline(net::time_point_t::clock::now() + net::time_sec_t(1))
+            .send(engine);
+        REQUIRE(req4.wait() == net::req_status::timeout);
+    }
+
+    SUBCASE("drain") {
+        net::engine engine;
+        engine.max_active_requests(1u);
+        net::performer performer(engine);
+
+        auto req1 = net::request_builder("https://httpbin.org/delay/1").send(engine);
+        auto req2 = net::request_builder("https://httpbin.org/status/200").send(engine);
+        REQUIRE(req1.wait_for(net::time_ms_t(100)) == net::req_status::pending);
+
+        const auto report1 = engine.drain(net::time_point_t::clock::now() + net::time_sec_t(5));
+        REQUIRE(report1.finished == 1u);
+        REQUIRE(report1.cancelled_active == 0u);
+        REQUIRE(report1.cancelled_queued == 1u);
+        REQUIRE(req1.take().http_code() == 200u);
+        REQUIRE(req2.status() == net::req_status::cancelled);
+
+        auto req3 = net::request_builder("https://httpbin.org/delay/3").send(engine);
+        REQUIRE(req3.wait_for(net::time_ms_t(100)) == net::req_status::pending);
+
+        const auto report2 = engine.drain(net::time_point_t::clock::now() + net::time_ms_t(100));
+        REQUIRE(report2.finished == 0u);
+        REQUIRE(report2.cancelled_active == 1u);
+        REQUIRE(req3.status() == net::req_status::cancelled);
+
+        // the engine admits requests again after the drain
+        auto req4 = net::request_builder("https://httpbin.org/status/200").send(engine);
+        REQUIRE(req4.take().http_code() == 200u);
+    }
+
+    SUBCASE("http2 multiplexing") {
+        // a local h2c server, like `nghttpd --no-tls --htdocs=untests 8766`
+        // with CURLY_HPP_H2C_URL=http://localhost:8766
+        const char* h2c_url = std::getenv("CURLY_HPP_H2C_URL");
+        if ( !h2c_url ) {
+            MESSAGE("CURLY_HPP_H2C_URL isn't set, skipped");
+            return;
+        }
+        if ( !(curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2) ) {
+            MESSAGE("libcurl is built without HTTP/2, skipped");
+            return;
+        }
+
+        net::engine engine;
+        REQUIRE(engine.multiplexing());
+        net::performer performer(engine);
+
+        std::vector<net::request_builder> builders;
+        for ( std::size_t i = 0; i < 10u; ++i ) {
+            builders.emplace_back(std::string(h2c_url) + "/CMakeLists.txt")
+                .version(net::http_version::http2_prior_knowledge)
+                .pipewait(true)
+                .stream_weight(32u);
+        }
+
+        // all the streams share the one connection
+        std::size_t new_connections = 0u;
+        for ( net::request& req : net::send_all(engine, std::move(builders)) ) {
+            const auto resp = req.take();
+            REQUIRE(resp.http_code() == 200u);
+            REQUIRE(resp.version() == net::http_version::http2);
+            new_connections += resp.stats.new_connections;
+        }
+        REQUIRE(new_connections == 1u);
+    }
+
+    SUBCASE("transfer stats") {
+        net::engine engine(2u);
+        net::performer performer(engine);
+
+        const auto resp1 = net::request_builder("https://httpbin.org/status/200").send(engine).take();
+        REQUIRE(resp1.stats.new_connections == 1u);
+        REQUIRE(resp1.stats.tls_handshake > net::time_us_t(0));
+        REQUIRE(resp1.stats.total >= resp1.stats.start_transfer);
+
+        const auto resp2 = net::request_builder("https://httpbin.org/status/201").send(engine).take();
+        REQUIRE(resp2.stats.new_connections == 0u);
+        REQUIRE(resp2.stats.tls_handshake == net::time_us_t(0));
+
+        // the engine spreads origins over shards by their hash,
+        // so pick another spelling of the same host on the other shard
+        const auto shard_of = [&engine](std::string_view origin){
+            return std::hash<std::string_view>()(origin) % engine.shard_count();
+        };
+        const std::vector<std::string> origins{
+            "https://HTTPBIN.ORG", "https://Httpbin.org", "https://httpbin.ORG",
+            "https://HttpBin.org", "https://httpBIN.org", "https://HTTPbin.org",
+            "https://httpbin.org:443", "https://HTTPBIN.ORG:443"};
+        const auto other = std::find_if(origins.begin(), origins.end(), [&shard_of](const std::string& o){
+            return shard_of(o) != shard_of("https://httpbin.org");
+        });
+        REQUIRE(other != origins.end());
+
+        // a new connection on its own shard, but the address
+        // comes from the dns cache shared by all the shards
+        const auto resp3 = net::request_builder(*other + "/status/202").send(engine).take();
+        REQUIRE(resp3.http_code() == 202u);
+        REQUIRE(resp3.stats.new_connections == 1u);
+        REQUIRE(resp3.stats.name_lookup < resp1.stats.name_lookup);
+    }
+
+#if defined(__linux__)
+    SUBCASE("external loop") {
+        net::engine engine;
+
+        std::map<net::socket_t, net::socket_events> sockets;
+        net::time_point_t timer = net::time_point_t::max();
+        std::atomic<bool> woken{false};
+
+        net::loop_hooks hooks;
+        hooks.watch = [&sockets](net::socket_t s, net::socket_events events){
+            if ( events.read || events.write ) {
+                sockets[s] = events;
+            } else {
+                sockets.erase(s);
+            }
+        };
+        hooks.timer = [&timer](net::time_point_t tp){
+            timer = tp;
+        };
+        hooks.wakeup = [&woken](){
+            woken.store(true);
+        };
+        REQUIRE_THROWS_AS(engine.on_timeout(), net::exception);
+        REQUIRE_THROWS_AS(net::engine(2u).attach_loop(hooks), net::exception);
+
+        auto req1 = net::request_builder("https://httpbin.org/status/200").send(engine);
+        engine.attach_loop(hooks);
+        REQUIRE_THROWS_AS(net::performer(engine), net::exception);
+
+        auto req2 = net::request_builder("https://httpbin.org/status/201").send(engine);
+        REQUIRE(woken.load());
+
+        while ( req1.is_pending() || req2.is_pending() ) {
+            if ( woken.exchange(false) ) {
+                engine.on_wakeup();
+            }
+
+            std::vector<pollfd> fds;
+            for ( const auto& [s, events] : sockets ) {
+                fds.push_back({static_cast<int>(s), static_cast<short>(
+                    (events.read ? POLLIN : 0) | (events.write ? POLLOUT : 0)), 0});
+            }
+            const auto timeout = timer == net::time_point_t::max()
+                ? net::time_ms_t(100)
+                : std::chrono::ceil<net::time_ms_t>(timer - net::time_point_t::clock::now());
+            ::poll(fds.data(), fds.size(), static_cast<int>(std::clamp(
+                timeout.count(), net::time_ms_t::rep(0), net::time_ms_t::rep(100))));
+
+            for ( const pollfd& fd : fds ) {
+                if ( fd.revents ) {
+                    net::socket_events events;
+                    events.read = fd.revents & POLLIN;
+                    events.write = fd.revents & POLLOUT;
+                    events.error = fd.revents & (POLLERR | POLLHUP);
+                    engine.on_socket_ready(fd.fd, events);
+                }
+            }
+            if ( net::time_point_t::clock::now() >= timer ) {
+                timer = net::time_point_t::max();
+                engine.on_timeout();
+            }
+        }
+
+        REQUIRE(req1.take().http_code() == 200u);
+        REQUIRE(req2.take().http_code() == 201u);
+    }
+
+    SUBCASE("performer thread options") {
+        net::engine engine(2u);
+
+        net::thread_options options;
+        options.name = "curly-net";
+        options.cpus = {0u};
+        net::performer performer(engine, options);
+
+        auto req = net::request_builder("https://httpbin.org/status/200").send(engine);
+        REQUIRE(req.take().http_code() == 200u);
+
+        net::thread_options bad_options;
+        bad_options.cpus = {~std::size_t(0u)};
+        REQUIRE_THROWS_AS(net::performer(engine, bad_options), net::exception);
+    }
+#endif
+
+    SUBCASE("busy polling performer") {
+        net::engine engine;
+        net::performer performer(engine);
+        REQUIRE(performer.spin_time() == net::time_us_t(0));
+
+        performer.spin_time(net::time_us_t(500));
+        performer.backoff_time(net::time_ms_t(1));
+        REQUIRE(performer.spin_time() == net::time_us_t(500));
+        REQUIRE(performer.backoff_time() == net::time_ms_t(1));
+
+        auto req1 = net::request_builder("https://httpbin.org/status/200").send(engine);
+        REQUIRE(req1.take().http_code() == 200u);
+
+        auto req2 = net::request_builder("https://httpbin.org/delay/1").send(engine);
+        REQUIRE(req2.take().http_code() == 200u);
+    }
+
+    SUBCASE("handle pool") {
+        net::engine engine;
+        REQUIRE(engine.handle_pool_size() > 0u);
+        net::performer performer(engine);
+
+        for ( std::size_t pool_size : {0u, 1u} ) {
+            engine.handle_pool_size(pool_size);
+            REQUIRE(engine.handle_pool_size() == pool_size);
+
+            auto req1 = net::request_builder(net::http_method::HEAD)
+                .url("https://httpbin.org/bytes/5")
+                .send(engine);
+            REQUIRE(req1.take().content.size() == 0u);
+
+            auto req2 = net::request_builder("https://httpbin.org/bytes/5").send(engine);
+            REQUIRE(req2.take().content.size() == 5u);
+        }
+    }
+
+    SUBCASE("pending requests from handlers") {
+        class inspecting_downloader : public net::download_handler {
+        public:
+            explicit inspecting_downloader(net::engine& engine)
+            : engine_(engine) {}
+
+            std::size_t write(const char* src, std::size_t size) override {
+                (void)src;
+                pending_ = engine_.get_all_pending_requests().size();
+                return size;
+            }
+
+            std::size_t pending() const noexcept {
+                return pending_;
+            }
+        private:
+            net::engine& engine_;
+            std::size_t pending_{0u};
+        };
+
+        net::engine engine;
+        net::performer performer(engine);
+
+        auto resp = net::request_builder("https://httpbin.org/bytes/5")
+            .downloader<inspecting_downloader>(engine)
+            .send(engine).take();
+        REQUIRE(resp.http_code() == 200u);
+        REQUIRE(static_cast<inspecting_downloader*>(resp.downloader.get())->pending() == 1u);
+    }
+
+    SUBCASE("shutdown") {
+        std::atomic_size_t call_count{0u};
+
+        net::request req = [&call_count](){
+            net::engine engine;
+            net::performer performer(engine);
+            return net::request_builder("https://httpbin.org/delay/2")
+                .callback([&call_count](net::request request){
+                    REQUIRE(request.status() == net::req_status::cancelled);
+                    ++call_count;
+                }).send(engine);
+        }();
+
+        REQUIRE(call_count == 1u);
+        REQUIRE(req.status() == net::req_status::cancelled);
+        REQUIRE_FALSE(req.cancel());
+    }
+}
+
+TEST_CASE("curly/send_all") {
+    net::engine engine(2u);
+    net::performer performer(engine);
+
+    std::vector<net::request_builder> builders;
+    builders.emplace_back("https://httpbin.org/status/200");
+    builders.emplace_back("https://httpbin.org/status/201");
+    builders.emplace_back("http://www.httpbin.org/status/202");
+
+    std::vector<net::request> requests = net::send_all(engine, std::move(builders));
+    REQUIRE(requests.size() == 3u);
+    REQUIRE(requests[0].take().http_code() == 200u);
+    REQUIRE(requests[1].take().http_code() == 201u);
+    REQUIRE(requests[2].take().http_code() == 202u);
+
+    REQUIRE(net::send_all(engine, {}).empty());
+}
+
+TEST_CASE("curly/executor") {
+    SUBCASE("thread_pool") {
+        net::thread_pool pool(2u);
+
+        std::atomic_size_t call_count{0u};
+        pool.post([&call_count](){ ++call_count; });
+        pool.executor()([&call_count](){ ++call_count; });
+
+        while ( call_count != 2u ) {
+            std::this_thread::yield();
+        }
+    }
+
+    SUBCASE("callbacks") {
+        net::thread_pool pool(1u);
+
+        net::engine engine;
+        engine.executor(pool.executor());
+        REQUIRE(engine.executor());
+
+        net::performer performer(engine);
+
+        std::atomic<std::thread::id> callback_thread;
+        auto req = net::request_builder("https://httpbin.org/status/200")
+            .callback([&callback_thread](net::request request){
+                REQUIRE(request.is_done());
+                callback_thread = std::this_thread::get_id();
+            }).send(engine);
+
+        REQUIRE(req.wait_callback() == net::req_status::done);
+        REQUIRE(callback_thread.load() != std::thread::id());
+        REQUIRE(callback_thread.load() != std::this_thread::get_id());
+    }
+
+    SUBCASE("custom executor") {
+        std::vector<net::task_t> tasks;
+
+        net::engine engine;
+        engine.executor([&tasks](net::task_t task){
+            tasks.push_back(std::move(task));
+        });
+
+        std::atomic_size_t call_count{0u};
+        auto req = net::request_builder("https://httpbin.org/delay/2")
+            .callback([&call_count](net::request request){
+                REQUIRE(request.status() == net::req_status::cancelled);
+                ++call_count;
+            }).send(engine);
+
+        engine.cancel_all_pending_requests();
+        REQUIRE(tasks.size() == 1u);
+        REQUIRE(call_count == 0u);
+
+        tasks.front()();
+        REQUIRE(call_count == 1u);
+        REQUIRE(req.wait_callback() == net::req_status::cancelled);
+    }
+}
+
+TEST_CASE("curly/completions") {
+    SUBCASE("disabled") {
+        net::engine engine;
+        net::performer performer(engine);
+        REQUIRE_FALSE(engine.completion_queue());
+
+        auto req = net::request_builder("https://httpbin.org/status/200").send(engine);
+        REQUIRE(req.wait() == net::req_status::done);
+
+        std::vector<net::request> completions;
+        REQUIRE(engine.poll_completions(completions, 10u) == 0u);
+        REQUIRE(completions.empty());
+    }
+
+    SUBCASE("poll and wait") {
+        net::engine engine;
+        engine.completion_queue(true);
+        REQUIRE(engine.completion_queue());
+        net::performer performer(engine);
+
+        std::vector<net::request_builder> builders;
+        for ( std::size_t i = 0; i < 3u; ++i ) {
+            builders.emplace_back("https://httpbin.org/status/200");
+        }
+        net::send_all(engine, std::move(builders));
+
+        std::vector<net::request> completions;
+        while ( completions.size() < 3u ) {
+            const std::size_t count = completions.size();
+            REQUIRE(engine.wait_completions(completions, 2u, net::time_sec_t(10)) <= 2u);
+            REQUIRE(completions.size() > count);
+        }
+
+        for ( const net::request& req : completions ) {
+            REQUIRE(req.status() == net::req_status::done);
+        }
+        REQUIRE(engine.poll_completions(completions, 10u) == 0u);
+    }
+
+    SUBCASE("cancelled requests") {
+        net::engine engine;
+        engine.completion_queue(true);
+
+        auto req = net::request_builder("https://httpbin.org/delay/2").send(engine);
+        engine.cancel_all_pending_requests();
+
+        std::vector<net::request> completions;
+        REQUIRE(engine.poll_completions(completions, 10u) == 1u);
+        REQUIRE(completions[0].status() == net::req_status::cancelled);
+    }
+}
+
+TEST_CASE("curly/set_shard_count") {
+    net::perform();
+    REQUIRE(net::shard_count() == 1u);
+    REQUIRE_THROWS_AS(net::set_shard_count(4u), net::exception);
+    REQUIRE(net::shard_count() == 1u);
+}
+
 TEST_CASE("curly_examples") {
     net::performer performer;
 